@@ -0,0 +1,114 @@
+#ifndef EDITOR_H
+#define EDITOR_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+// Compile main.c with -DEDITOR_LIBRARY to build the engine without the
+// stdin driver and link it into another program through this header.
+
+//=======================================================
+// ERROR
+//=======================================================
+
+#define ERROR_MEMORY_ALLOCATION     (-1000)
+#define ERROR_HISTORY_EMPTY         (-1001)
+#define ERROR_INDEX_OUT_OF_BOUNDS   (-1002)
+
+#define ERROR_UNKNOWN_COMMAND       (-1020)
+#define ERROR_MISSING_COMMAND       (-1021)
+#define ERROR_COMMAND_PARAMETERS    (-1022)
+
+//=======================================================
+// COMMANDS
+//=======================================================
+
+#define COMMAND_CHANGE ('c')
+#define COMMAND_DELETE ('d')
+#define COMMAND_UNDO ('u')
+#define COMMAND_REDO ('r')
+#define COMMAND_PRINT ('p')
+// `Nv` prints what changed since N steps back as hunks, see editor_diff()
+#define COMMAND_DIFF ('v')
+// `a,bf` prints a 64-bit hex fingerprint of what `a,bp` would print
+#define COMMAND_FINGERPRINT ('f')
+#define COMMAND_EXIT ('q')
+
+// A pre-parsed command, the same fields main() extracts from a text line.
+// For COMMAND_CHANGE, `data` holds `lines_count` lines back to back, each
+// followed by one separator byte, with `data_sizes[i]` the length of line i
+// without the separator. The editor references these bytes instead of
+// copying them, so they must stay valid until editor_destroy().
+typedef struct {
+    char command;
+    int first_index;
+    int second_index;
+
+    char* data;
+    size_t data_size;
+    size_t* data_sizes;
+    size_t lines_count;
+} editor_command_t;
+
+//=======================================================
+// EDITOR
+//=======================================================
+
+typedef struct editor editor_t;
+
+// Receives everything the editor prints. Returns the number of bytes consumed.
+typedef size_t (*editor_sink_t)(void* context, const char* data, size_t size);
+
+// `sink` may be NULL, in which case output goes to stdout.
+editor_t* editor_create(editor_sink_t sink, void* context);
+void editor_destroy(editor_t* editor);
+
+// Applies `count` commands in order and stops at the first failure or at
+// COMMAND_EXIT. History and row storage are reserved once for the whole
+// batch and runs of undo/redo are resolved lazily, only when a later
+// command needs the document.
+int editor_apply(editor_t* editor, const editor_command_t* commands, size_t count);
+
+//=======================================================
+// HISTORY_COMPACTION
+//=======================================================
+
+// Totals since the editor was created. raw_bytes / packed_bytes is the
+// compression ratio of the packed nodes.
+typedef struct {
+    size_t compacted_nodes;
+    size_t raw_bytes;
+    size_t packed_bytes;
+
+    size_t inflated_nodes;
+    double inflate_seconds;
+} editor_history_stats_t;
+
+// History nodes further than `distance` steps from the current position
+// are packed and compressed, and expanded again when undo or redo reaches
+// them. Setting or lowering the distance packs the nodes already beyond it.
+// 0, the default, disables compaction.
+void editor_set_history_compaction(editor_t* editor, size_t distance);
+void editor_history_stats(const editor_t* editor, editor_history_stats_t* stats);
+
+//=======================================================
+// HISTORY_COALESCING
+//=======================================================
+
+// Consecutive changes on overlapping line ranges are grouped into runs that
+// undo and redo with a single replay when the step count spans the rest of
+// the run. Counts ending inside a run restore the nearest checkpoint kept in
+// the run and replay only the nodes after it. Every change is still one
+// history step. Off by default, since each change then also records its own
+// lines for redo, and checkpoints take up to as much again.
+void editor_set_history_coalescing(editor_t* editor, bool enabled);
+
+//=======================================================
+// FINGERPRINT
+//=======================================================
+
+// Keeps the output of recent prints keyed by range and fingerprint, so a
+// print of an unchanged range is replayed with one sink call. Off by default.
+void editor_set_print_cache(editor_t* editor, bool enabled);
+
+#endif //EDITOR_H
@@ -7,19 +7,162 @@
 #include <ctype.h>
 #include <fcntl.h>
 #include <fcntl.h>
+#include <stdint.h>
+#include <time.h>
 
+#include "editor.h"
 
 //=======================================================
-// ERROR
+// LZ
 //=======================================================
 
-#define ERROR_MEMORY_ALLOCATION     (-1000)
-#define ERROR_HISTORY_EMPTY         (-1001)
-#define ERROR_INDEX_OUT_OF_BOUNDS   (-1002)
+// Byte-oriented LZ77 block codec (LZ4-like sequences): a token with literal
+// and match length nibbles, extra length bytes for nibbles equal to 15, the
+// literals, then a 2 byte little-endian offset. The last sequence carries
+// literals only.
+
+#define LZ_MIN_MATCH (4)
+#define LZ_HASH_BITS (12)
+#define LZ_MAX_OFFSET (65535)
+
+static size_t lz_bound(size_t size) {
+    return size + size / 255 + 16;
+}
+
+static size_t lz_put_length(unsigned char* dst, size_t out, size_t length) {
+    while (length >= 255) {
+        dst[out++] = 255;
+        length -= 255;
+    }
+    dst[out++] = (unsigned char) length;
+
+    return out;
+}
+
+static size_t lz_emit(unsigned char* dst, size_t out,
+                      const unsigned char* literals, size_t literals_count,
+                      size_t offset, size_t match) {
+    size_t match_code = match ? match - LZ_MIN_MATCH : 0;
+    size_t literals_nibble = literals_count < 15 ? literals_count : 15;
+    size_t match_nibble = match_code < 15 ? match_code : 15;
+    dst[out++] = (unsigned char) ((literals_nibble << 4) | match_nibble);
+
+    if (literals_count >= 15) {
+        out = lz_put_length(dst, out, literals_count - 15);
+    }
+    memcpy(dst + out, literals, literals_count);
+    out += literals_count;
+
+    if (match) {
+        dst[out++] = (unsigned char) (offset & 0xFF);
+        dst[out++] = (unsigned char) (offset >> 8);
+        if (match_code >= 15) {
+            out = lz_put_length(dst, out, match_code - 15);
+        }
+    }
+
+    return out;
+}
+
+// `dst` must hold at least lz_bound(size) bytes.
+static size_t lz_compress(const unsigned char* src, size_t size, unsigned char* dst) {
+    uint32_t table[1 << LZ_HASH_BITS];
+    memset(table, 0, sizeof(table));
+
+    size_t anchor = 0;
+    size_t pos = 0;
+    size_t out = 0;
+
+    while (pos + LZ_MIN_MATCH <= size) {
+        uint32_t sequence;
+        memcpy(&sequence, src + pos, sizeof(sequence));
+        uint32_t hash = (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+
+        // positions are stored +1 so that 0 marks an empty slot
+        size_t candidate = table[hash];
+        table[hash] = (uint32_t) (pos + 1);
+
+        if (0 == candidate || pos - (candidate - 1) > LZ_MAX_OFFSET ||
+            memcmp(src + candidate - 1, src + pos, LZ_MIN_MATCH) != 0) {
+            ++pos;
+            continue;
+        }
+        --candidate;
+
+        size_t match = LZ_MIN_MATCH;
+        while (pos + match < size && src[candidate + match] == src[pos + match]) {
+            ++match;
+        }
+
+        out = lz_emit(dst, out, src + anchor, pos - anchor, pos - candidate, match);
+        pos += match;
+        anchor = pos;
+    }
+
+    return lz_emit(dst, out, src + anchor, size - anchor, 0, 0);
+}
+
+static int lz_get_length(const unsigned char* src, size_t size, size_t* in, size_t* length) {
+    unsigned char byte;
+    do {
+        if (*in >= size) {
+            return ERROR_INDEX_OUT_OF_BOUNDS;
+        }
+        byte = src[(*in)++];
+        *length += byte;
+    } while (255 == byte);
+
+    return 0;
+}
+
+// Fails unless `src` decodes to exactly `capacity` bytes.
+static int lz_decompress(const unsigned char* src, size_t size,
+                         unsigned char* dst, size_t capacity) {
+    size_t in = 0;
+    size_t out = 0;
+
+    while (in < size) {
+        unsigned char token = src[in++];
+
+        size_t literals_count = token >> 4;
+        if (15 == literals_count && lz_get_length(src, size, &in, &literals_count)) {
+            return ERROR_INDEX_OUT_OF_BOUNDS;
+        }
+        if (literals_count > size - in || literals_count > capacity - out) {
+            return ERROR_INDEX_OUT_OF_BOUNDS;
+        }
+        memcpy(dst + out, src + in, literals_count);
+        in += literals_count;
+        out += literals_count;
+
+        if (in >= size) {
+            break;
+        }
+
+        if (size - in < 2) {
+            return ERROR_INDEX_OUT_OF_BOUNDS;
+        }
+        size_t offset = src[in] | ((size_t) src[in + 1] << 8);
+        in += 2;
+
+        size_t match = token & 15;
+        if (15 == match && lz_get_length(src, size, &in, &match)) {
+            return ERROR_INDEX_OUT_OF_BOUNDS;
+        }
+        match += LZ_MIN_MATCH;
+
+        if (0 == offset || offset > out || match > capacity - out) {
+            return ERROR_INDEX_OUT_OF_BOUNDS;
+        }
+        // byte by byte: the source may overlap the bytes being written
+        for (size_t i = 0; i < match; ++i) {
+            dst[out + i] = dst[out - offset + i];
+        }
+        out += match;
+    }
 
-#define ERROR_UNKNOWN_COMMAND       (-1020)
-#define ERROR_MISSING_COMMAND       (-1021)
-#define ERROR_COMMAND_PARAMETERS    (-1022)
+    return out == capacity ? 0 : ERROR_INDEX_OUT_OF_BOUNDS;
+}
 
 //=======================================================
 // COMMAND_HISTORY
@@ -30,6 +173,8 @@ typedef enum {
     DELETE
 } command_type_t;
 
+typedef struct history_run history_run_t;
+
 typedef struct {
     command_type_t type;
 
@@ -41,13 +186,72 @@ typedef struct {
     size_t line_start;
     size_t line_count;
     size_t row_count;
+
+    // line references of a compacted node, see node_pack()
+    unsigned char* packed;
+    size_t packed_size;
+    size_t packed_raw_size;
+
+    // set on every node of a coalesced run of CHANGE nodes
+    history_run_t* run;
 } history_node_t;
 
+// The union of a run right after node `index`: lines
+// [line_start, MIN(line_end, row_count)), the rest of the union being as
+// before the run. See run_checkpoint().
+typedef struct {
+    size_t index;
+    size_t row_count;
+    size_t line_start;
+    size_t line_end;
+    char** data;
+    size_t* data_sizes;
+} run_checkpoint_t;
+
+// Consecutive CHANGE nodes on overlapping ranges, with a composite record
+// that undoes or redoes all of them with a single change_lines().
+struct history_run {
+    size_t first;
+    size_t last;
+
+    // union of the changed ranges and the row count before the run
+    size_t line_start;
+    size_t line_end;
+    size_t row_count;
+
+    // lines [line_start, MIN(line_end, row_count)) before the run
+    char** old_data;
+    size_t* old_data_sizes;
+    // old_data and old_data_sizes point old_data_front entries into these,
+    // which keep spare room on both ends for extend_run()
+    char** old_data_block;
+    size_t* old_data_sizes_block;
+    size_t old_data_front;
+    size_t old_data_capacity;
+    // lines [line_start, MIN(line_end, data_row_count)) after the run,
+    // captured on undo together with the row count after the run
+    char** data;
+    size_t* data_sizes;
+    size_t data_row_count;
+
+    // states inside the run by increasing index, so undo and redo that end
+    // inside it restore the nearest one and replay only the nodes left
+    run_checkpoint_t* checkpoints;
+    size_t checkpoints_count;
+    size_t checkpoints_capacity;
+    // lines written by the nodes since the last checkpoint
+    size_t checkpoint_lines;
+};
+
 typedef struct {
     history_node_t* nodes;
     ssize_t index;
     size_t count;
     size_t capacity;
+
+    // nodes further than this from index get compacted, 0 disables it
+    size_t compaction_distance;
+    editor_history_stats_t stats;
 } history_t;
 
 #define HISTORY_INITIAL_CAPACITY (20)
@@ -57,23 +261,304 @@ static void free_node_contents(history_node_t* node) {
     free(node->data_sizes);
     free(node->old_data);
     free(node->old_data_sizes);
+    free(node->packed);
     node->data = NULL;
     node->data_sizes = NULL;
     node->old_data = NULL;
     node->old_data_sizes = NULL;
+    node->packed = NULL;
+}
+
+//=======================================================
+// HISTORY_COMPACTION
+//=======================================================
+
+// The lines a node refers to live in the input buffer (or the caller's
+// command data), so packing copies references, not bytes: every line becomes
+// a zigzag varint delta from where the previous line ended plus a varint
+// size. Consecutive input lines encode as a 0 delta, and the LZ pass then
+// folds the repetitive size runs.
+
+#define VARINT_MAX_SIZE (10)
+
+static size_t node_old_data_count(const history_node_t* node) {
+    if (CHANGE == node->type && node->line_start + node->line_count > node->row_count) {
+        return node->row_count - node->line_start;
+    }
+
+    return node->line_count;
+}
+
+static size_t put_varint(unsigned char* dst, size_t out, uint64_t value) {
+    while (value >= 0x80) {
+        dst[out++] = (unsigned char) (value | 0x80);
+        value >>= 7;
+    }
+    dst[out++] = (unsigned char) value;
+
+    return out;
+}
+
+static int get_varint(const unsigned char* src, size_t size, size_t* in, uint64_t* value) {
+    *value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (*in >= size) {
+            return ERROR_INDEX_OUT_OF_BOUNDS;
+        }
+        unsigned char byte = src[(*in)++];
+        *value |= (uint64_t) (byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            return 0;
+        }
+    }
+
+    return ERROR_INDEX_OUT_OF_BOUNDS;
+}
+
+static size_t pack_lines(unsigned char* dst, size_t out, uintptr_t* expected,
+                         char** lines, const size_t* sizes, size_t count) {
+    if (NULL == lines) {
+        return put_varint(dst, out, 0);
+    }
+
+    out = put_varint(dst, out, count + 1);
+    for (size_t i = 0; i < count; ++i) {
+        uint64_t delta = (uint64_t) ((uintptr_t) lines[i] - *expected);
+        out = put_varint(dst, out, (delta << 1) ^ (uint64_t) ((int64_t) delta >> 63));
+        out = put_varint(dst, out, sizes[i]);
+        *expected = (uintptr_t) lines[i] + sizes[i] + 1;
+    }
+
+    return out;
+}
+
+static int unpack_lines(const unsigned char* src, size_t size, size_t* in, uintptr_t* expected,
+                        char*** lines, size_t** sizes) {
+    uint64_t count;
+    if (get_varint(src, size, in, &count)) {
+        return ERROR_INDEX_OUT_OF_BOUNDS;
+    }
+
+    *lines = NULL;
+    *sizes = NULL;
+    if (0 == count--) {
+        return 0;
+    }
+
+    char** data = (char**) malloc(sizeof(char*) * count);
+    size_t* data_sizes = (size_t*) malloc(sizeof(size_t) * count);
+    if (NULL == data || NULL == data_sizes) {
+        free(data);
+        free(data_sizes);
+        return ERROR_MEMORY_ALLOCATION;
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+        uint64_t zigzag;
+        uint64_t line_size;
+        if (get_varint(src, size, in, &zigzag) || get_varint(src, size, in, &line_size)) {
+            free(data);
+            free(data_sizes);
+            return ERROR_INDEX_OUT_OF_BOUNDS;
+        }
+
+        uint64_t delta = (zigzag >> 1) ^ (uint64_t) -(int64_t) (zigzag & 1);
+        data[i] = (char*) (*expected + (uintptr_t) delta);
+        data_sizes[i] = line_size;
+        *expected = (uintptr_t) data[i] + line_size + 1;
+    }
+
+    *lines = data;
+    *sizes = data_sizes;
+    return 0;
+}
+
+static int node_pack(history_t* history, history_node_t* node) {
+    if (NULL != node->packed || (NULL == node->old_data && NULL == node->data)) {
+        return 0;
+    }
+
+    size_t old_count = NULL == node->old_data ? 0 : node_old_data_count(node);
+    size_t data_count = NULL == node->data ? 0 : node->line_count;
+    size_t raw_bytes = (old_count + data_count) * (sizeof(char*) + sizeof(size_t));
+
+    unsigned char* raw = (unsigned char*) malloc(VARINT_MAX_SIZE * (2 + 2 * (old_count + data_count)));
+    if (NULL == raw) {
+        return ERROR_MEMORY_ALLOCATION;
+    }
+
+    uintptr_t expected = 0;
+    size_t raw_size = pack_lines(raw, 0, &expected, node->old_data, node->old_data_sizes, old_count);
+    raw_size = pack_lines(raw, raw_size, &expected, node->data, node->data_sizes, data_count);
+
+    unsigned char* packed = (unsigned char*) malloc(lz_bound(raw_size));
+    if (NULL == packed) {
+        free(raw);
+        return ERROR_MEMORY_ALLOCATION;
+    }
+    size_t packed_size = lz_compress(raw, raw_size, packed);
+    free(raw);
+
+    if (packed_size >= raw_bytes) {
+        // not worth it, keep the node expanded
+        free(packed);
+        return 0;
+    }
+
+    unsigned char* shrunk = (unsigned char*) realloc(packed, packed_size);
+    if (NULL != shrunk) {
+        packed = shrunk;
+    }
+
+    free_node_contents(node);
+    node->packed = packed;
+    node->packed_size = packed_size;
+    node->packed_raw_size = raw_size;
+
+    ++history->stats.compacted_nodes;
+    history->stats.raw_bytes += raw_bytes;
+    history->stats.packed_bytes += packed_size;
+
+    return 0;
+}
+
+// Decodes the line references of a packed node into new arrays, leaving the
+// node packed. `data` and `data_sizes` may be NULL when only the old lines
+// are needed.
+static int node_decode(const history_node_t* node, char*** old_data, size_t** old_data_sizes,
+                       char*** data, size_t** data_sizes) {
+    unsigned char* raw = (unsigned char*) malloc(node->packed_raw_size);
+    if (NULL == raw) {
+        return ERROR_MEMORY_ALLOCATION;
+    }
+
+    int result = lz_decompress(node->packed, node->packed_size, raw, node->packed_raw_size);
+    if (result) {
+        free(raw);
+        return result;
+    }
+
+    size_t in = 0;
+    uintptr_t expected = 0;
+    result = unpack_lines(raw, node->packed_raw_size, &in, &expected, old_data, old_data_sizes);
+    if (!result && NULL != data) {
+        result = unpack_lines(raw, node->packed_raw_size, &in, &expected, data, data_sizes);
+        if (result) {
+            free(*old_data);
+            free(*old_data_sizes);
+            *old_data = NULL;
+            *old_data_sizes = NULL;
+        }
+    }
+    free(raw);
+
+    return result;
+}
+
+static int node_unpack(history_t* history, history_node_t* node) {
+    if (NULL == node->packed) {
+        return 0;
+    }
+
+    struct timespec begin;
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+
+    int result = node_decode(node, &node->old_data, &node->old_data_sizes,
+                             &node->data, &node->data_sizes);
+    if (result) {
+        return result;
+    }
+
+    free(node->packed);
+    node->packed = NULL;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    ++history->stats.inflated_nodes;
+    history->stats.inflate_seconds += (double) (end.tv_sec - begin.tv_sec) +
+                                      (double) (end.tv_nsec - begin.tv_nsec) / 1e9;
+
+    return 0;
+}
+
+// Called whenever index moves by one, so each node gets packed as it
+// crosses the distance in either direction.
+static void command_history_compact(history_t* history) {
+    if (0 == history->compaction_distance) {
+        return;
+    }
+
+    ssize_t behind = history->index - (ssize_t) history->compaction_distance;
+    if (behind >= 0) {
+        node_pack(history, history->nodes + behind);
+    }
+
+    size_t ahead = history->index + history->compaction_distance + 1;
+    if (ahead < history->count) {
+        node_pack(history, history->nodes + ahead);
+    }
 }
 
-int command_history_init(history_t* history) {
+// Packs every node already beyond `distance`, which command_history_compact()
+// would otherwise only reach once index moves past it.
+static void command_history_set_compaction(history_t* history, size_t distance) {
+    history->compaction_distance = distance;
+    if (0 == distance) {
+        return;
+    }
+
+    for (ssize_t i = 0; i <= history->index - (ssize_t) distance; ++i) {
+        node_pack(history, history->nodes + i);
+    }
+    for (size_t i = history->index + distance + 1; i < history->count; ++i) {
+        node_pack(history, history->nodes + i);
+    }
+}
+
+static void free_run_data(history_run_t* run) {
+    free(run->data);
+    free(run->data_sizes);
+    run->data = NULL;
+    run->data_sizes = NULL;
+}
+// Drops the checkpoints after node `last`.
+static void free_run_checkpoints(history_run_t* run, size_t last) {
+    while (run->checkpoints_count > 0 && run->checkpoints[run->checkpoints_count - 1].index > last) {
+        run_checkpoint_t* checkpoint = run->checkpoints + --run->checkpoints_count;
+        free(checkpoint->data);
+        free(checkpoint->data_sizes);
+    }
+}
+static void free_node_run(history_t* history, size_t index) {
+    history_run_t* run = history->nodes[index].run;
+    if (NULL == run || run->first != index) {
+        return;
+    }
+
+    free_run_data(run);
+    free_run_checkpoints(run, 0);
+    free(run->checkpoints);
+    free(run->old_data_block);
+    free(run->old_data_sizes_block);
+    free(run);
+}
+
+static int command_history_init(history_t* history) {
     history->nodes = (history_node_t*) malloc(sizeof(history_node_t) * HISTORY_INITIAL_CAPACITY);
 
     history->index = -1;
     history->count = 0;
     history->capacity = HISTORY_INITIAL_CAPACITY;
 
+    history->compaction_distance = 0;
+    memset(&history->stats, 0, sizeof(history->stats));
+
     return 0;
 }
-void command_history_free(history_t* history) {
-    for (int i = 0; i < history->count; ++i) {
+static void command_history_free(history_t* history) {
+    // backwards, so a run is freed with its first node after the rest
+    for (int i = history->count - 1; i >= 0; --i) {
+        free_node_run(history, i);
         free_node_contents(history->nodes + i);
     }
 
@@ -83,7 +568,30 @@ void command_history_free(history_t* history) {
     history->count = 0;
     history->capacity = 0;
 }
-int command_history_append(history_t* history, const history_node_t* node) {
+// Drops the nodes after index, cutting short a run that continued past it.
+static void command_history_discard_redo(history_t* history) {
+    if (history->index + 1 >= history->count) {
+        return;
+    }
+
+    for (int i = history->count - 1; i > history->index; --i) {
+        free_node_run(history, i);
+        free_node_contents(history->nodes + i);
+    }
+    history->count = history->index + 1;
+
+    if (history->index < 0) {
+        return;
+    }
+
+    history_run_t* run = history->nodes[history->index].run;
+    if (NULL != run && run->last > history->index) {
+        run->last = history->index;
+        free_run_data(run);
+        free_run_checkpoints(run, run->last);
+    }
+}
+static int command_history_append(history_t* history, const history_node_t* node) {
     if (history->index + 1 >= history->capacity) {
         size_t new_capacity = (size_t) (history->capacity * 2);
         history_node_t* new_nodes = (history_node_t*) realloc(history->nodes, sizeof(history_node_t) * new_capacity);
@@ -95,32 +603,36 @@ int command_history_append(history_t* history, const history_node_t* node) {
         history->capacity = new_capacity;
     }
 
+    command_history_discard_redo(history);
     ++history->index;
-    if (history->index < history->count) {
-        // override nodes
-        for (int i = history->index; i < history->count; ++i) {
-            free_node_contents(history->nodes + i);
-        }
-    }
 
     history_node_t* node_in_history = history->nodes + history->index;
     memcpy(node_in_history, node, sizeof(history_node_t));
     history->count = history->index + 1;
 
+    command_history_compact(history);
+
     return 0;
 }
-int command_history_forward(history_t* history, history_node_t* node) {
+static int command_history_forward(history_t* history, history_node_t* node) {
     if (history->index + 1 >= history->count) {
         return ERROR_HISTORY_EMPTY;
     }
 
+    history_node_t* node_in_history = history->nodes + history->index + 1;
+    int result = node_unpack(history, node_in_history);
+    if (result) {
+        return result;
+    }
+
     ++history->index;
-    history_node_t* node_in_history = history->nodes + history->index;
     memcpy(node, node_in_history, sizeof(history_node_t));
 
+    command_history_compact(history);
+
     return 0;
 }
-int command_history_back(history_t* history, history_node_t* node) {
+static int command_history_back(history_t* history, history_node_t* node) {
     if (history->index < -1) {
         return ERROR_HISTORY_EMPTY;
     }
@@ -130,13 +642,49 @@ int command_history_back(history_t* history, history_node_t* node) {
     }
 
     history_node_t* node_in_history = history->nodes + history->index;
+    int result = node_unpack(history, node_in_history);
+    if (result) {
+        return result;
+    }
+
     memcpy(node, node_in_history, sizeof(history_node_t));
     --history->index;
 
+    command_history_compact(history);
+
+    return 0;
+}
+
+// Moves index without replaying the nodes in between.
+static void command_history_skip(history_t* history, ssize_t index) {
+    if (0 == history->compaction_distance) {
+        history->index = index;
+        return;
+    }
+
+    while (history->index != index) {
+        history->index += history->index < index ? 1 : -1;
+        command_history_compact(history);
+    }
+}
+
+static int command_history_reserve(history_t* history, size_t capacity) {
+    if (capacity <= history->capacity) {
+        return 0;
+    }
+
+    history_node_t* new_nodes = (history_node_t*) realloc(history->nodes, sizeof(history_node_t) * capacity);
+    if (NULL == new_nodes) {
+        return ERROR_MEMORY_ALLOCATION;
+    }
+
+    history->nodes = new_nodes;
+    history->capacity = capacity;
+
     return 0;
 }
 
-int command_history_update(history_t* history, history_node_t* node) {
+static int command_history_update(history_t* history, history_node_t* node) {
     history_node_t* node_in_history = history->nodes + history->index + 1;
     memcpy(node_in_history, node, sizeof(history_node_t));
 
@@ -147,20 +695,51 @@ int command_history_update(history_t* history, history_node_t* node) {
 // EDITOR
 //=======================================================
 
+// A rendered `p` of [line_start, line_start + lines_count), valid while the
+// range still has the same fingerprint.
 typedef struct {
+    size_t line_start;
+    size_t lines_count;
+    uint64_t fingerprint;
+
+    char* output;
+    size_t size;
+    size_t capacity;
+} print_cache_entry_t;
+
+struct editor {
     char** rows;
     size_t* sizes;
     size_t row_count;
     size_t row_capacity;
 
+    // line hashes, 0 until computed, and per block hashes of
+    // FINGERPRINT_BLOCK_SIZE lines; both follow the rows around
+    uint64_t* hashes;
+    uint64_t* block_hashes;
+    bool* block_valid;
+    size_t block_capacity;
+
+    bool print_cache_enabled;
+    print_cache_entry_t* print_cache;
+
     ssize_t delayed_history_change_count;
 
     history_t history;
-} editor_t;
+    bool coalesce_history;
+
+    editor_sink_t sink;
+    void* sink_context;
+};
 
 #define EDITOR_INITIAL_CAPACITY (20)
 #define MAX_LINE_SIZE (1024)
 
+#define FINGERPRINT_BLOCK_SIZE (64)
+#define PRINT_CACHE_SIZE (64)
+// larger prints are streamed as without the cache, so it holds 4 MiB at most
+#define PRINT_CACHE_ENTRY_MAX_SIZE (64 * 1024)
+
 #define MIN(X, Y) (((X) < (Y)) ? (X) : (Y))
 #define NORMALIZE_LINE(l) \
     (l) = MIN((l), editor->row_count - 1)
@@ -170,18 +749,43 @@ static int expand_buffers(editor_t* editor, size_t needed_size) {
     size_t new_capacity = (size_t) (needed_size * 2);
     char** rows = (char**) realloc(editor->rows, sizeof(char*) * new_capacity);
     size_t* sizes = (size_t*) realloc(editor->sizes, sizeof(size_t) * new_capacity);
+    uint64_t* hashes = (uint64_t*) realloc(editor->hashes, sizeof(uint64_t) * new_capacity);
 
     for (int i = editor->row_capacity; i < new_capacity; ++i) {
         sizes[i] = 0;
+        hashes[i] = 0;
+    }
+
+    size_t block_capacity = new_capacity / FINGERPRINT_BLOCK_SIZE + 1;
+    uint64_t* block_hashes = (uint64_t*) realloc(editor->block_hashes, sizeof(uint64_t) * block_capacity);
+    bool* block_valid = (bool*) realloc(editor->block_valid, sizeof(bool) * block_capacity);
+
+    for (int i = editor->block_capacity; i < block_capacity; ++i) {
+        block_valid[i] = false;
     }
 
 
     editor->rows = rows;
     editor->sizes = sizes;
+    editor->hashes = hashes;
     editor->row_capacity = new_capacity;
+    editor->block_hashes = block_hashes;
+    editor->block_valid = block_valid;
+    editor->block_capacity = block_capacity;
 
     return 0;
 }
+// Marks the blocks holding lines [line_start, line_end) for recomputation.
+static void invalidate_blocks(editor_t* editor, size_t line_start, size_t line_end) {
+    if (line_end <= line_start) {
+        return;
+    }
+
+    size_t block_end = (line_end - 1) / FINGERPRINT_BLOCK_SIZE;
+    for (size_t i = line_start / FINGERPRINT_BLOCK_SIZE; i <= block_end; ++i) {
+        editor->block_valid[i] = false;
+    }
+}
 static int copy_lines(editor_t* editor, size_t line_start, size_t lines_count,
                       char*** buffer, size_t** sizes) {
     if (0 == lines_count) {
@@ -194,9 +798,9 @@ static int copy_lines(editor_t* editor, size_t line_start, size_t lines_count,
     char** data = (char**) malloc(sizeof(char*) * lines_count);
 
 
-    for (int i = line_start; i < line_start + lines_count; ++i) {
+    for (int i = 0; i < lines_count; ++i) {
         data_sizes[i] = editor->sizes[line_start + i];
-        data[i] = editor->rows[i];
+        data[i] = editor->rows[line_start + i];
     }
 
     *buffer = data;
@@ -208,7 +812,9 @@ static int change_lines(editor_t* editor, size_t line_start, size_t lines_count,
     for (int i = 0; i < lines_count; ++i) {
         editor->sizes[line_start + i] = sizes[i];
         editor->rows[line_start + i] = data[i];
+        editor->hashes[line_start + i] = 0;
     }
+    invalidate_blocks(editor, line_start, line_start + lines_count);
 
     if (line_start + lines_count > editor->row_count) {
         editor->row_count = line_start + lines_count;
@@ -222,8 +828,10 @@ static int change_lines2(editor_t* editor, size_t line_start, size_t lines_count
     for (int i = 0; i < lines_count; ++i) {
         editor->sizes[line_start + i] = sizes[i];
         editor->rows[line_start + i] = data + offset;
+        editor->hashes[line_start + i] = 0;
         offset += sizes[i] + 1;
     }
+    invalidate_blocks(editor, line_start, line_start + lines_count);
 
     if (line_start + lines_count > editor->row_count) {
         editor->row_count = line_start + lines_count;
@@ -238,6 +846,7 @@ static int delete_lines(editor_t* editor, size_t line_start, size_t lines_count)
         if (line_end + i < editor->row_count) {
             editor->sizes[line_start + i] = editor->sizes[line_end + i];
             editor->rows[line_start + i] = editor->rows[line_end + i];
+            editor->hashes[line_start + i] = editor->hashes[line_end + i];
             /*memcpy(ROW(editor, (line_start + i)),
                    ROW(editor, (line_end + i)),
                    editor->sizes[line_start + i]);*/
@@ -245,6 +854,7 @@ static int delete_lines(editor_t* editor, size_t line_start, size_t lines_count)
             //ROW(editor, (line_start + i))[editor->sizes[line_start + i]] = '\0';
         }
     }
+    invalidate_blocks(editor, line_start, editor->row_count);
 
     if (lines_count >= editor->row_count) {
         editor->row_count = 0;
@@ -255,14 +865,25 @@ static int delete_lines(editor_t* editor, size_t line_start, size_t lines_count)
     return 0;
 }
 
-int editor_init(editor_t* editor) {
+static size_t stream_sink(void* context, const char* data, size_t size) {
+    return fwrite(data, 1, size, (FILE*) context);
+}
+
+static int editor_init(editor_t* editor) {
     char** rows = (char**) malloc(sizeof(char*) * EDITOR_INITIAL_CAPACITY);
     size_t* sizes = (size_t*) malloc(sizeof(size_t) * EDITOR_INITIAL_CAPACITY);
+    uint64_t* hashes = (uint64_t*) malloc(sizeof(uint64_t) * EDITOR_INITIAL_CAPACITY);
 
-
+    size_t block_capacity = EDITOR_INITIAL_CAPACITY / FINGERPRINT_BLOCK_SIZE + 1;
+    uint64_t* block_hashes = (uint64_t*) malloc(sizeof(uint64_t) * block_capacity);
+    bool* block_valid = (bool*) malloc(sizeof(bool) * block_capacity);
 
     for (int i = 0; i < EDITOR_INITIAL_CAPACITY; ++i) {
         sizes[i] = 0;
+        hashes[i] = 0;
+    }
+    for (int i = 0; i < block_capacity; ++i) {
+        block_valid[i] = false;
     }
 
     command_history_init(&editor->history);
@@ -271,13 +892,33 @@ int editor_init(editor_t* editor) {
     editor->sizes = sizes;
     editor->row_count = 0;
     editor->row_capacity = EDITOR_INITIAL_CAPACITY;
+    editor->hashes = hashes;
+    editor->block_hashes = block_hashes;
+    editor->block_valid = block_valid;
+    editor->block_capacity = block_capacity;
+    editor->print_cache_enabled = false;
+    editor->print_cache = NULL;
     editor->delayed_history_change_count = 0;
+    editor->coalesce_history = false;
+    editor->sink = stream_sink;
+    editor->sink_context = stdout;
 
     return 0;
 }
-void editor_free(editor_t* editor) {
+static void editor_free(editor_t* editor) {
     free(editor->rows);
     free(editor->sizes);
+    free(editor->hashes);
+    free(editor->block_hashes);
+    free(editor->block_valid);
+
+    if (NULL != editor->print_cache) {
+        for (int i = 0; i < PRINT_CACHE_SIZE; ++i) {
+            free(editor->print_cache[i].output);
+        }
+        free(editor->print_cache);
+        editor->print_cache = NULL;
+    }
 
     editor->row_count = 0;
     editor->row_capacity = 0;
@@ -285,36 +926,355 @@ void editor_free(editor_t* editor) {
     command_history_free(&editor->history);
 }
 
-int editor_change(editor_t* editor,
-                  size_t line_start, size_t lines_count,
-                  char* input, size_t input_size, size_t* input_sizes) {
-    if (line_start > editor->row_count) {
-        // error, not linked to existing rows
-        return ERROR_INDEX_OUT_OF_BOUNDS;
+// Makes room for `front` more old lines before the run's and `back` more
+// after them, growing the blocks geometrically so a run that keeps widening
+// one line at a time stays linear.
+static int reserve_run_old_data(history_run_t* run, size_t old_count, size_t front, size_t back) {
+    if (front <= run->old_data_front
+        && back <= run->old_data_capacity - run->old_data_front - old_count) {
+        return 0;
     }
 
-    int result;
+    size_t needed = front + old_count + back;
+    size_t capacity = 2 * needed;
+    char** block = (char**) malloc(sizeof(char*) * capacity);
+    size_t* sizes_block = (size_t*) malloc(sizeof(size_t) * capacity);
+    if (NULL == block || NULL == sizes_block) {
+        free(block);
+        free(sizes_block);
+        return ERROR_MEMORY_ALLOCATION;
+    }
 
-    if (line_start + lines_count >= editor->row_capacity) {
-        result = expand_buffers(editor, line_start + lines_count);
-        if (result) {
-            return result;
-        }
+    // split the spare room evenly, the run may keep growing either way
+    size_t data_front = front + (capacity - needed) / 2;
+    if (old_count > 0) {
+        memcpy(block + data_front, run->old_data, sizeof(char*) * old_count);
+        memcpy(sizes_block + data_front, run->old_data_sizes, sizeof(size_t) * old_count);
     }
 
-    history_node_t history = {
-            .type = CHANGE,
-            .line_start = line_start,
-            .line_count = lines_count,
-            .row_count = editor->row_count,
-            .old_data = NULL,
-            .old_data_sizes = NULL,
-            .data = NULL,
-            .data_sizes = NULL
-    };
+    free(run->old_data_block);
+    free(run->old_data_sizes_block);
+    run->old_data_block = block;
+    run->old_data_sizes_block = sizes_block;
+    run->old_data_front = data_front;
+    run->old_data_capacity = capacity;
 
-    char* *old_data;
-    size_t* old_data_sizes;
+    return 0;
+}
+
+// Widens the run to [line_start, line_end), taking the pre-run content of
+// the newly covered lines from the rows, which the run has not touched yet.
+static int extend_run(editor_t* editor, history_run_t* run, size_t line_start, size_t line_end) {
+    size_t new_start = MIN(run->line_start, line_start);
+    size_t new_end = run->line_end > line_end ? run->line_end : line_end;
+    if (new_start == run->line_start && new_end == run->line_end) {
+        return 0;
+    }
+
+    size_t old_end = MIN(run->line_end, run->row_count);
+    size_t new_old_end = MIN(new_end, run->row_count);
+    size_t old_count = old_end - run->line_start;
+    size_t front = run->line_start - new_start;
+    size_t back = new_old_end - old_end;
+
+    if (front + back > 0) {
+        if (reserve_run_old_data(run, old_count, front, back)) {
+            return ERROR_MEMORY_ALLOCATION;
+        }
+
+        run->old_data_front -= front;
+        char** old_data = run->old_data_block + run->old_data_front;
+        size_t* old_data_sizes = run->old_data_sizes_block + run->old_data_front;
+
+        memcpy(old_data, editor->rows + new_start, sizeof(char*) * front);
+        memcpy(old_data_sizes, editor->sizes + new_start, sizeof(size_t) * front);
+        memcpy(old_data + front + old_count, editor->rows + old_end, sizeof(char*) * back);
+        memcpy(old_data_sizes + front + old_count, editor->sizes + old_end, sizeof(size_t) * back);
+
+        run->old_data = old_data;
+        run->old_data_sizes = old_data_sizes;
+    }
+
+    run->line_start = new_start;
+    run->line_end = new_end;
+
+    return 0;
+}
+
+// Returns the run a CHANGE of [line_start, line_start + lines_count) joins,
+// starting one from the previous node if needed, or NULL when the previous
+// node is not a CHANGE on an overlapping range. Must run before the rows
+// are changed.
+static history_run_t* coalesce_change(editor_t* editor, size_t line_start, size_t lines_count) {
+    history_t* history = &editor->history;
+    command_history_discard_redo(history);
+    if (history->index < 0) {
+        return NULL;
+    }
+
+    history_node_t* previous = history->nodes + history->index;
+    if (CHANGE != previous->type) {
+        return NULL;
+    }
+
+    history_run_t* run = previous->run;
+    size_t run_start = NULL == run ? previous->line_start : run->line_start;
+    size_t run_end = NULL == run ? previous->line_start + previous->line_count : run->line_end;
+    if (line_start > run_end || line_start + lines_count < run_start) {
+        return NULL;
+    }
+
+    if (NULL == run) {
+        if (node_unpack(history, previous)) {
+            return NULL;
+        }
+        if (NULL == previous->data) {
+            // the rows still hold what previous wrote
+            copy_lines(editor, previous->line_start, previous->line_count,
+                       &previous->data, &previous->data_sizes);
+        }
+
+        run = (history_run_t*) calloc(1, sizeof(history_run_t));
+        if (NULL == run) {
+            return NULL;
+        }
+
+        run->first = history->index;
+        run->line_start = previous->line_start;
+        run->line_end = previous->line_start + previous->line_count;
+        run->row_count = previous->row_count;
+
+        size_t old_count = node_old_data_count(previous);
+        if (NULL != previous->old_data && old_count > 0) {
+            run->old_data = (char**) malloc(sizeof(char*) * old_count);
+            run->old_data_sizes = (size_t*) malloc(sizeof(size_t) * old_count);
+            if (NULL == run->old_data || NULL == run->old_data_sizes) {
+                free(run->old_data);
+                free(run->old_data_sizes);
+                free(run);
+                return NULL;
+            }
+            memcpy(run->old_data, previous->old_data, sizeof(char*) * old_count);
+            memcpy(run->old_data_sizes, previous->old_data_sizes, sizeof(size_t) * old_count);
+
+            run->old_data_block = run->old_data;
+            run->old_data_sizes_block = run->old_data_sizes;
+            run->old_data_capacity = old_count;
+        }
+
+        previous->run = run;
+    }
+
+    if (extend_run(editor, run, line_start, line_start + lines_count)) {
+        return NULL;
+    }
+
+    free_run_data(run);
+    run->last = history->index + 1;
+
+    return run;
+}
+
+#define RUN_CHECKPOINT_LINES (64)
+
+// Records the union after the run's newest node once the nodes since the
+// previous checkpoint wrote at least as many lines as the union holds. So
+// checkpoints never take more memory than the nodes themselves, and the
+// nodes between two of them write about one union's worth of lines.
+static void run_checkpoint(editor_t* editor, history_run_t* run, size_t lines_count) {
+    size_t width = MIN(run->line_end, editor->row_count) - run->line_start;
+    run->checkpoint_lines += lines_count;
+    if (run->checkpoint_lines < width || run->checkpoint_lines < RUN_CHECKPOINT_LINES) {
+        return;
+    }
+
+    if (run->checkpoints_count >= run->checkpoints_capacity) {
+        size_t new_capacity = run->checkpoints_capacity ? run->checkpoints_capacity * 2 : 8;
+        run_checkpoint_t* checkpoints = (run_checkpoint_t*) realloc(run->checkpoints,
+                                                                    sizeof(run_checkpoint_t) * new_capacity);
+        if (NULL == checkpoints) {
+            // only a shortcut, undo and redo still work node by node
+            return;
+        }
+        run->checkpoints = checkpoints;
+        run->checkpoints_capacity = new_capacity;
+    }
+
+    run_checkpoint_t* checkpoint = run->checkpoints + run->checkpoints_count++;
+    checkpoint->index = run->last;
+    checkpoint->row_count = editor->row_count;
+    checkpoint->line_start = run->line_start;
+    checkpoint->line_end = run->line_end;
+    copy_lines(editor, run->line_start, width, &checkpoint->data, &checkpoint->data_sizes);
+
+    run->checkpoint_lines = 0;
+}
+
+// Writes back the pre-run lines [line_start, line_end) of the union.
+static void run_restore_old_lines(editor_t* editor, history_run_t* run, size_t line_start, size_t line_end) {
+    line_end = MIN(line_end, run->row_count);
+    if (line_start < line_end) {
+        change_lines(editor, line_start, line_end - line_start,
+                     run->old_data + (line_start - run->line_start),
+                     run->old_data_sizes + (line_start - run->line_start));
+    }
+}
+
+// Every state inside a run differs from another only within the union, so
+// these move the rows from any of them straight to the one named.
+static void run_restore_start(editor_t* editor, history_run_t* run) {
+    run_restore_old_lines(editor, run, run->line_start, run->line_end);
+    editor->row_count = run->row_count;
+}
+static void run_restore_end(editor_t* editor, history_run_t* run) {
+    change_lines(editor, run->line_start, MIN(run->line_end, run->data_row_count) - run->line_start,
+                 run->data, run->data_sizes);
+    editor->row_count = run->data_row_count;
+}
+static void run_restore_checkpoint(editor_t* editor, history_run_t* run, const run_checkpoint_t* checkpoint) {
+    // the union grew since, and what it gained was still as before the run
+    run_restore_old_lines(editor, run, run->line_start, checkpoint->line_start);
+    run_restore_old_lines(editor, run, checkpoint->line_end, run->line_end);
+
+    change_lines(editor, checkpoint->line_start,
+                 MIN(checkpoint->line_end, checkpoint->row_count) - checkpoint->line_start,
+                 checkpoint->data, checkpoint->data_sizes);
+    editor->row_count = checkpoint->row_count;
+}
+
+// The first checkpoint at or after node `index`, or NULL.
+static const run_checkpoint_t* run_checkpoint_after(const history_run_t* run, size_t index) {
+    size_t low = 0;
+    size_t high = run->checkpoints_count;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (run->checkpoints[middle].index < index) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low < run->checkpoints_count ? run->checkpoints + low : NULL;
+}
+// The last checkpoint at or before node `index`, or NULL.
+static const run_checkpoint_t* run_checkpoint_before(const history_run_t* run, size_t index) {
+    const run_checkpoint_t* checkpoint = run_checkpoint_after(run, index + 1);
+    if (NULL == checkpoint) {
+        checkpoint = run->checkpoints + run->checkpoints_count;
+    }
+    return checkpoint == run->checkpoints ? NULL : checkpoint - 1;
+}
+
+// Undoes inside the run holding index in one step: the whole rest of the run
+// when `count` covers it, otherwise up to the nearest checkpoint at or after
+// the target, which leaves less than one checkpoint interval of nodes to
+// undo one by one.
+static bool undo_run(editor_t* editor, size_t* count) {
+    history_t* history = &editor->history;
+    if (history->index < 0) {
+        return false;
+    }
+
+    history_run_t* run = history->nodes[history->index].run;
+    if (NULL == run) {
+        return false;
+    }
+
+    if (NULL == run->data) {
+        if (run->last != history->index) {
+            return false;
+        }
+        // a run cut short by discard_redo may span past the rows it left
+        run->data_row_count = editor->row_count;
+        copy_lines(editor, run->line_start, MIN(run->line_end, editor->row_count) - run->line_start,
+                   &run->data, &run->data_sizes);
+    }
+
+    size_t index = history->index;
+    if (*count >= index - run->first + 1) {
+        run_restore_start(editor, run);
+        command_history_skip(history, (ssize_t) run->first - 1);
+        *count -= index - run->first + 1;
+        return true;
+    }
+
+    const run_checkpoint_t* checkpoint = run_checkpoint_after(run, index - *count);
+    if (NULL == checkpoint || checkpoint->index >= index) {
+        return false;
+    }
+
+    run_restore_checkpoint(editor, run, checkpoint);
+    command_history_skip(history, (ssize_t) checkpoint->index);
+    *count -= index - checkpoint->index;
+
+    return true;
+}
+// Redoes inside the run after index in one step, the same way as undo_run().
+static bool redo_run(editor_t* editor, size_t* count) {
+    history_t* history = &editor->history;
+    if (history->index + 1 >= history->count) {
+        return false;
+    }
+
+    history_run_t* run = history->nodes[history->index + 1].run;
+    if (NULL == run || NULL == run->data) {
+        return false;
+    }
+
+    size_t index = history->index + 1;
+    if (*count >= run->last - index + 1) {
+        run_restore_end(editor, run);
+        command_history_skip(history, (ssize_t) run->last);
+        *count -= run->last - index + 1;
+        return true;
+    }
+
+    const run_checkpoint_t* checkpoint = run_checkpoint_before(run, index - 1 + *count);
+    if (NULL == checkpoint || checkpoint->index < index) {
+        return false;
+    }
+
+    run_restore_checkpoint(editor, run, checkpoint);
+    command_history_skip(history, (ssize_t) checkpoint->index);
+    *count -= checkpoint->index - (index - 1);
+
+    return true;
+}
+
+static int editor_change(editor_t* editor,
+                         size_t line_start, size_t lines_count,
+                         char* input, size_t input_size, size_t* input_sizes) {
+    if (line_start > editor->row_count) {
+        // error, not linked to existing rows
+        return ERROR_INDEX_OUT_OF_BOUNDS;
+    }
+
+    int result;
+
+    if (line_start + lines_count >= editor->row_capacity) {
+        result = expand_buffers(editor, line_start + lines_count);
+        if (result) {
+            return result;
+        }
+    }
+
+    history_node_t history = {
+            .type = CHANGE,
+            .line_start = line_start,
+            .line_count = lines_count,
+            .row_count = editor->row_count,
+            .old_data = NULL,
+            .old_data_sizes = NULL,
+            .data = NULL,
+            .data_sizes = NULL
+    };
+
+    if (editor->coalesce_history) {
+        history.run = coalesce_change(editor, line_start, lines_count);
+    }
+
+    char* *old_data;
+    size_t* old_data_sizes;
     size_t buffer_lines_count = lines_count;
     if(line_start + lines_count > editor->row_count) {
         buffer_lines_count = editor->row_count - line_start;
@@ -323,14 +1283,23 @@ int editor_change(editor_t* editor,
     copy_lines(editor, line_start, buffer_lines_count, &old_data, &old_data_sizes);
     change_lines2(editor, line_start, lines_count, input, input_sizes);
 
+    if (editor->coalesce_history) {
+        // a run may be undone as a whole, so redo can't rely on undo capturing data
+        copy_lines(editor, line_start, lines_count, &history.data, &history.data_sizes);
+    }
+
     history.old_data = old_data;
     history.old_data_sizes = old_data_sizes;
     command_history_append(&editor->history, &history);
 
+    if (NULL != history.run) {
+        run_checkpoint(editor, history.run, lines_count);
+    }
+
     return 0;
 }
-int editor_delete(editor_t* editor,
-                  size_t line_start, size_t lines_count) {
+static int editor_delete(editor_t* editor,
+                         size_t line_start, size_t lines_count) {
     if (0 == editor->row_count) {
         history_node_t history = {
                 .type = DELETE,
@@ -343,175 +1312,878 @@ int editor_delete(editor_t* editor,
                 .data_sizes = NULL
         };
 
-        return command_history_append(&editor->history, &history);
+        return command_history_append(&editor->history, &history);
+    }
+
+    if (line_start >= editor->row_count) {
+        // nothing to delete, still one step of history
+        line_start = editor->row_count;
+    }
+    if(lines_count >= editor->row_count - line_start) {
+        lines_count = editor->row_count - line_start;
+    }
+
+    history_node_t history = {
+            .type = DELETE,
+            .line_start = line_start,
+            .line_count = lines_count,
+            .row_count = editor->row_count,
+            .old_data = NULL,
+            .old_data_sizes = NULL,
+            .data = NULL,
+            .data_sizes = NULL
+    };
+
+    char** old_data;
+    size_t* old_data_sizes;
+    copy_lines(editor, line_start, lines_count, &old_data, &old_data_sizes);
+    delete_lines(editor, line_start, lines_count);
+
+    history.old_data = old_data;
+    history.old_data_sizes = old_data_sizes;
+    command_history_append(&editor->history, &history);
+
+    return 0;
+}
+static int editor_undo(editor_t* editor, size_t count) {
+    int result;
+    history_node_t node;
+
+    while (count > 0) {
+        if (undo_run(editor, &count)) {
+            continue;
+        }
+        --count;
+
+        result = command_history_back(&editor->history, &node);
+        if (result) {
+            return 0;
+        }
+
+        switch (node.type) {
+            case CHANGE: {
+                if (NULL == node.data) {
+                    char** old_data;
+                    size_t* old_data_sizes;
+                    copy_lines(editor, node.line_start, node.line_count, &old_data, &old_data_sizes);
+
+                    node.data = old_data;
+                    node.data_sizes = old_data_sizes;
+
+                    command_history_update(&editor->history, &node);
+                }
+
+                if (NULL == node.old_data) {
+                    editor->row_count = node.row_count;
+                    continue;
+                }
+
+                if (node.line_start + node.line_count >= node.row_count) {
+                    change_lines(editor,
+                                          node.line_start, node.row_count - node.line_start,
+                                          node.old_data, node.old_data_sizes);
+                } else {
+                    change_lines(editor,
+                                          node.line_start, node.line_count,
+                                          node.old_data, node.old_data_sizes);
+                }
+                break;
+            }
+            case DELETE: {
+                size_t line_end = node.line_start + node.line_count;
+                for (int i = editor->row_count - node.line_start - 1; i >= 0; --i) {
+                    editor->sizes[line_end + i] = editor->sizes[node.line_start + i];
+                    editor->rows[line_end + i] = editor->rows[node.line_start + i];
+                    editor->hashes[line_end + i] = editor->hashes[node.line_start + i];
+                    /*memcpy(ROW(editor, line_end + i),
+                           ROW(editor, node.line_start + i),
+                           editor->sizes[line_end + i]);*/
+                    //ROW(editor, line_end + i)[editor->sizes[line_end + i]] = '\0';
+                }
+                invalidate_blocks(editor, node.line_start, node.row_count);
+
+                if (NULL == node.old_data) {
+                    editor->row_count = node.row_count;
+                    continue;
+                }
+
+                change_lines(editor,
+                                      node.line_start, node.line_count,
+                                      node.old_data, node.old_data_sizes);
+                break;
+            }
+        }
+
+        editor->row_count = node.row_count;
+    }
+
+    return 0;
+}
+static int editor_redo(editor_t* editor, size_t count) {
+    int result;
+    history_node_t node;
+
+    while (count > 0) {
+        if (redo_run(editor, &count)) {
+            continue;
+        }
+        --count;
+
+        result = command_history_forward(&editor->history, &node);
+        if (result) {
+            return 0;
+        }
+
+        switch (node.type) {
+            case CHANGE:
+                change_lines(editor,
+                                      node.line_start, node.line_count,
+                                      node.data, node.data_sizes);
+                break;
+            case DELETE: {
+                if (editor->row_count > 0) {
+                    delete_lines(editor,
+                                          node.line_start, node.line_count);
+                }
+                break;
+            }
+        }
+    }
+
+    return 0;
+}
+
+static const char EMPTY_LINE_BUFFER[] = ".\n";
+static const char NEW_LINE_BUFFER[] = "\n";
+
+//=======================================================
+// FINGERPRINT
+//=======================================================
+
+// The fingerprint of a range is the polynomial sum of its line hashes,
+// F(l0..ln) = h(l0) * BASE^n + ... + h(ln), so F(X + Y) = F(X) * BASE^|Y| + F(Y)
+// and whole blocks fold in from their cached hash. Missing lines hash as
+// the "." they print as, which makes equal fingerprints mean equal `p` output.
+
+#define FINGERPRINT_BASE (0x9E3779B97F4A7C15ull)
+
+static uint64_t hash_bytes(const char* data, size_t size) {
+    uint64_t hash = 0xCBF29CE484222325ull;
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= (unsigned char) data[i];
+        hash *= 0x100000001B3ull;
+    }
+
+    // mix so that the hashes add up well in the polynomial
+    hash ^= hash >> 33;
+    hash *= 0xFF51AFD7ED558CCDull;
+    hash ^= hash >> 33;
+
+    return 0 == hash ? 1 : hash;
+}
+
+static uint64_t missing_line_hash(void) {
+    static uint64_t hash = 0;
+    if (0 == hash) {
+        hash = hash_bytes(EMPTY_LINE_BUFFER, 1);
+    }
+    return hash;
+}
+
+// BASE^count and BASE^(count - 1) + ... + BASE + 1, by squaring: BASE - 1 is
+// even, so the closed form has no inverse to divide by modulo 2^64.
+static void fingerprint_powers(size_t count, uint64_t* power, uint64_t* sum) {
+    uint64_t result_power = 1;
+    uint64_t result_sum = 0;
+    uint64_t square_power = FINGERPRINT_BASE;
+    uint64_t square_sum = 1;
+    while (count > 0) {
+        if (count & 1) {
+            result_sum = result_sum * square_power + square_sum;
+            result_power *= square_power;
+        }
+        square_sum = square_sum * square_power + square_sum;
+        square_power *= square_power;
+        count >>= 1;
+    }
+
+    *power = result_power;
+    *sum = result_sum;
+}
+
+static uint64_t line_hash(editor_t* editor, size_t line) {
+    if (line >= editor->row_count) {
+        return missing_line_hash();
+    }
+
+    if (0 == editor->hashes[line]) {
+        editor->hashes[line] = hash_bytes(editor->rows[line], editor->sizes[line]);
+    }
+
+    return editor->hashes[line];
+}
+
+static uint64_t block_hash(editor_t* editor, size_t block) {
+    if (!editor->block_valid[block]) {
+        uint64_t hash = 0;
+        size_t line_start = block * FINGERPRINT_BLOCK_SIZE;
+        for (size_t i = line_start; i < line_start + FINGERPRINT_BLOCK_SIZE; ++i) {
+            hash = hash * FINGERPRINT_BASE + line_hash(editor, i);
+        }
+
+        editor->block_hashes[block] = hash;
+        editor->block_valid[block] = true;
+    }
+
+    return editor->block_hashes[block];
+}
+
+static uint64_t editor_fingerprint(editor_t* editor, size_t line_start, size_t lines_count) {
+    uint64_t block_base = 1;
+    for (int i = 0; i < FINGERPRINT_BLOCK_SIZE; ++i) {
+        block_base *= FINGERPRINT_BASE;
+    }
+
+    uint64_t fingerprint = 0;
+    size_t line_end = line_start + lines_count;
+    size_t i = line_start;
+    while (i < line_end) {
+        if (i >= editor->row_count) {
+            // the missing lines all hash the same, fold them in at once
+            uint64_t power;
+            uint64_t sum;
+            fingerprint_powers(line_end - i, &power, &sum);
+            fingerprint = fingerprint * power + missing_line_hash() * sum;
+            break;
+        }
+
+        if (0 == i % FINGERPRINT_BLOCK_SIZE &&
+            i + FINGERPRINT_BLOCK_SIZE <= line_end && i + FINGERPRINT_BLOCK_SIZE <= editor->row_count) {
+            fingerprint = fingerprint * block_base + block_hash(editor, i / FINGERPRINT_BLOCK_SIZE);
+            i += FINGERPRINT_BLOCK_SIZE;
+        } else {
+            fingerprint = fingerprint * FINGERPRINT_BASE + line_hash(editor, i);
+            ++i;
+        }
+    }
+
+    return fingerprint;
+}
+
+// Same output as the plain loop in editor_print(), rendered once per range
+// and fingerprint and replayed with a single sink call. Returns false, having
+// printed nothing, when the range is too large to keep or the memory for it
+// is not there, and the caller prints it line by line instead.
+static bool print_cached(editor_t* editor, size_t line_start, size_t lines_count) {
+    // every line takes at least its '\n'
+    if (lines_count > PRINT_CACHE_ENTRY_MAX_SIZE) {
+        return false;
+    }
+
+    if (NULL == editor->print_cache) {
+        editor->print_cache = (print_cache_entry_t*) calloc(PRINT_CACHE_SIZE, sizeof(print_cache_entry_t));
+        if (NULL == editor->print_cache) {
+            return false;
+        }
+    }
+
+    uint64_t fingerprint = editor_fingerprint(editor, line_start, lines_count);
+    print_cache_entry_t* entry = editor->print_cache + (line_start * 31 + lines_count) % PRINT_CACHE_SIZE;
+
+    if (NULL == entry->output || entry->line_start != line_start ||
+        entry->lines_count != lines_count || entry->fingerprint != fingerprint) {
+        size_t size = 0;
+        for (size_t i = line_start; i < line_start + lines_count; ++i) {
+            size += i < editor->row_count ? editor->sizes[i] + 1 : 2;
+        }
+        if (size > PRINT_CACHE_ENTRY_MAX_SIZE) {
+            return false;
+        }
+
+        if (size > entry->capacity) {
+            char* output = (char*) realloc(entry->output, size);
+            if (NULL == output) {
+                return false;
+            }
+            entry->output = output;
+            entry->capacity = size;
+        }
+
+        size_t offset = 0;
+        for (size_t i = line_start; i < line_start + lines_count; ++i) {
+            if (i >= editor->row_count) {
+                memcpy(entry->output + offset, EMPTY_LINE_BUFFER, 2);
+                offset += 2;
+            } else {
+                memcpy(entry->output + offset, editor->rows[i], editor->sizes[i]);
+                offset += editor->sizes[i];
+                entry->output[offset++] = '\n';
+            }
+        }
+
+        entry->line_start = line_start;
+        entry->lines_count = lines_count;
+        entry->fingerprint = fingerprint;
+        entry->size = size;
+    }
+
+    editor->sink(editor->sink_context, entry->output, entry->size);
+
+    return true;
+}
+
+static int editor_print(editor_t* editor,
+                        size_t line_start, size_t lines_count) {
+    if (editor->print_cache_enabled && print_cached(editor, line_start, lines_count)) {
+        return 0;
+    }
+
+    for (size_t i = line_start; i < line_start + lines_count; ++i) {
+        if (i >= editor->row_count) {
+            // have a huge buffer and print some of it depending on how many empty lines
+            editor->sink(editor->sink_context, EMPTY_LINE_BUFFER, 2);
+        } else {
+            editor->sink(editor->sink_context, editor->rows[i], editor->sizes[i]);
+            editor->sink(editor->sink_context, NEW_LINE_BUFFER, 1);
+        }
+    }
+
+    return 0;
+}
+
+static int editor_change_history(editor_t* editor) {
+    int result = 0;
+    if (editor->delayed_history_change_count > 0) {
+        result = editor_redo(editor, editor->delayed_history_change_count);
+    } else if (editor->delayed_history_change_count < 0) {
+        result = editor_undo(editor, -editor->delayed_history_change_count);
+    }
+
+    editor->delayed_history_change_count = 0;
+    return result;
+}
+
+//=======================================================
+// DIFF
+//=======================================================
+
+// A version is a history position: the document after node `version`, with
+// -1 the empty document before any command.
+//
+// editor_diff() follows the lines of one version through the nodes after it
+// in a rope: a treap of segments of lines that are still lines base, base+1,
+// ... of the followed version, or lines it does not follow. Each node splits
+// out the lines it replaced, reads the followed ones from its old_data and
+// puts untracked lines in their place, so each node is visited once however
+// many lines the diff prints.
+
+#define ROPE_NIL (-1)
+#define ROPE_UNTRACKED (SIZE_MAX)
+
+typedef struct {
+    size_t base;
+    size_t length;
+    // lines in the subtree
+    size_t total;
+    uint32_t priority;
+    int left;
+    int right;
+} rope_segment_t;
+
+typedef struct {
+    rope_segment_t* segments;
+    size_t count;
+    size_t capacity;
+    uint32_t seed;
+    int root;
+} rope_t;
+
+// Receives the segments in line order, `position` being where each starts.
+typedef void (*rope_visitor_t)(void* context, size_t base, size_t length, size_t position);
+
+// Every rope_replace() adds at most 3 segments, so `capacity` is reserved
+// once and the tree operations never fail.
+static int rope_init(rope_t* rope, size_t capacity) {
+    rope->segments = (rope_segment_t*) malloc(sizeof(rope_segment_t) * capacity);
+    rope->count = 0;
+    rope->capacity = capacity;
+    rope->seed = 2463534242u;
+    rope->root = ROPE_NIL;
+
+    return NULL == rope->segments ? ERROR_MEMORY_ALLOCATION : 0;
+}
+static void rope_free(rope_t* rope) {
+    free(rope->segments);
+    rope->segments = NULL;
+}
+
+static size_t rope_total(const rope_t* rope, int tree) {
+    return ROPE_NIL == tree ? 0 : rope->segments[tree].total;
+}
+static void rope_update(rope_t* rope, int tree) {
+    rope_segment_t* segment = rope->segments + tree;
+    segment->total = rope_total(rope, segment->left) + segment->length + rope_total(rope, segment->right);
+}
+
+static int rope_new(rope_t* rope, size_t base, size_t length) {
+    // xorshift32
+    rope->seed ^= rope->seed << 13;
+    rope->seed ^= rope->seed >> 17;
+    rope->seed ^= rope->seed << 5;
+
+    int tree = (int) rope->count++;
+    rope_segment_t* segment = rope->segments + tree;
+    segment->base = base;
+    segment->length = length;
+    segment->total = length;
+    segment->priority = rope->seed;
+    segment->left = ROPE_NIL;
+    segment->right = ROPE_NIL;
+
+    return tree;
+}
+
+// Splits `tree` into its first `position` lines and the rest.
+static void rope_split(rope_t* rope, int tree, size_t position, int* left, int* right) {
+    if (ROPE_NIL == tree) {
+        *left = ROPE_NIL;
+        *right = ROPE_NIL;
+        return;
+    }
+
+    rope_segment_t* segment = rope->segments + tree;
+    size_t left_total = rope_total(rope, segment->left);
+    if (position <= left_total) {
+        rope_split(rope, segment->left, position, left, &segment->left);
+        *right = tree;
+    } else if (position >= left_total + segment->length) {
+        rope_split(rope, segment->right, position - left_total - segment->length, &segment->right, right);
+        *left = tree;
+    } else {
+        // cut the segment, its tail takes its place in the right part
+        size_t offset = position - left_total;
+        int tail = rope_new(rope, ROPE_UNTRACKED == segment->base ? ROPE_UNTRACKED : segment->base + offset,
+                            segment->length - offset);
+        rope->segments[tail].priority = segment->priority;
+        rope->segments[tail].right = segment->right;
+        rope_update(rope, tail);
+
+        segment->length = offset;
+        segment->right = ROPE_NIL;
+        *left = tree;
+        *right = tail;
+    }
+
+    rope_update(rope, tree);
+}
+
+static int rope_merge(rope_t* rope, int left, int right) {
+    if (ROPE_NIL == left) {
+        return right;
+    }
+    if (ROPE_NIL == right) {
+        return left;
+    }
+
+    if (rope->segments[left].priority > rope->segments[right].priority) {
+        int merged = rope_merge(rope, rope->segments[left].right, right);
+        rope->segments[left].right = merged;
+        rope_update(rope, left);
+        return left;
+    }
+
+    int merged = rope_merge(rope, left, rope->segments[right].left);
+    rope->segments[right].left = merged;
+    rope_update(rope, right);
+    return right;
+}
+
+static void rope_append(rope_t* rope, size_t base, size_t length) {
+    if (length > 0) {
+        rope->root = rope_merge(rope, rope->root, rope_new(rope, base, length));
     }
+}
 
-    if(line_start + lines_count >= editor->row_count) {
-        lines_count = editor->row_count - line_start;
+static void rope_walk(const rope_t* rope, int tree, size_t position, rope_visitor_t visit, void* context) {
+    if (ROPE_NIL == tree) {
+        return;
     }
 
-    history_node_t history = {
-            .type = DELETE,
-            .line_start = line_start,
-            .line_count = lines_count,
-            .row_count = editor->row_count,
-            .old_data = NULL,
-            .old_data_sizes = NULL,
-            .data = NULL,
-            .data_sizes = NULL
-    };
+    const rope_segment_t* segment = rope->segments + tree;
+    rope_walk(rope, segment->left, position, visit, context);
+    position += rope_total(rope, segment->left);
+    visit(context, segment->base, segment->length, position);
+    rope_walk(rope, segment->right, position + segment->length, visit, context);
+}
+
+// Replaces lines [line_start, line_start + removed) with `inserted` untracked
+// lines, passing the removed segments to `visit` at their offset in the range.
+static void rope_replace(rope_t* rope, size_t line_start, size_t removed, size_t inserted,
+                         rope_visitor_t visit, void* context) {
+    int left;
+    int middle;
+    int right;
+    rope_split(rope, rope->root, line_start, &left, &middle);
+    rope_split(rope, middle, removed, &middle, &right);
+    rope_walk(rope, middle, 0, visit, context);
+
+    middle = inserted > 0 ? rope_new(rope, ROPE_UNTRACKED, inserted) : ROPE_NIL;
+    rope->root = rope_merge(rope, rope_merge(rope, left, middle), right);
+}
 
+// Lines [old_start, old_start + old_len) of the older version became lines
+// [new_start, new_start + new_len) of the newer one. Lines between hunks are
+// equal.
+typedef struct {
+    size_t old_start;
+    size_t old_len;
+    size_t new_start;
+    size_t new_len;
+} diff_hunk_t;
+
+typedef struct {
+    size_t line;
+    char* row;
+    size_t size;
+} diff_line_t;
+
+typedef struct {
+    editor_t* editor;
+    rope_t rope;
+    int result;
+
+    // the node being walked, its old lines decoded on first use if packed
+    const history_node_t* node;
     char** old_data;
     size_t* old_data_sizes;
-    copy_lines(editor, line_start, lines_count, &old_data, &old_data_sizes);
-    delete_lines(editor, line_start, lines_count);
+    bool decoded;
+
+    diff_hunk_t* hunks;
+    size_t hunks_count;
+    size_t hunks_capacity;
+    // where the next hunk would start on each side, and whether it has
+    bool hunk_open;
+    size_t old_position;
+    size_t hunk_old_start;
+    size_t hunk_new_start;
+
+    // the older version's lines the nodes removed, in any order
+    diff_line_t* old_lines;
+    size_t old_lines_count;
+    size_t old_lines_capacity;
+
+    // the newer version's lines inside hunks, back to back
+    char** new_rows;
+    size_t* new_sizes;
+} diff_t;
+
+// The lines `node` replaced in the version before it and how many it wrote.
+static bool node_edit(const history_node_t* node, size_t* removed, size_t* inserted) {
+    if (node->line_start > node->row_count || (DELETE == node->type && node->line_start == node->row_count)) {
+        return false;
+    }
 
-    history.old_data = old_data;
-    history.old_data_sizes = old_data_sizes;
-    command_history_append(&editor->history, &history);
+    *removed = MIN(node->line_count, node->row_count - node->line_start);
+    *inserted = CHANGE == node->type ? node->line_count : 0;
+    return true;
+}
 
-    return 0;
+// Rows of the document at `version`, which is at most the history index.
+static size_t version_row_count(editor_t* editor, ssize_t version) {
+    history_t* history = &editor->history;
+    return version == history->index ? editor->row_count : history->nodes[version + 1].row_count;
 }
-int editor_undo(editor_t* editor, size_t count) {
-    int result;
-    history_node_t node;
 
-    while (count-- > 0) {
-        result = command_history_back(&editor->history, &node);
-        if (result) {
-            return 0;
-        }
+static int diff_node_old_data(diff_t* diff) {
+    if (NULL != diff->old_data || diff->result) {
+        return diff->result;
+    }
 
-        switch (node.type) {
-            case CHANGE: {
-                if (NULL == node.data) {
-                    char** old_data;
-                    size_t* old_data_sizes;
-                    copy_lines(editor, node.line_start, node.line_count, &old_data, &old_data_sizes);
+    if (NULL == diff->node->packed) {
+        diff->old_data = diff->node->old_data;
+        diff->old_data_sizes = diff->node->old_data_sizes;
+    } else {
+        // left packed and out of the stats, a diff must not move compaction
+        diff->result = node_decode(diff->node, &diff->old_data, &diff->old_data_sizes, NULL, NULL);
+        diff->decoded = !diff->result;
+    }
 
-                    node.data = old_data;
-                    node.data_sizes = old_data_sizes;
+    return diff->result;
+}
 
-                    command_history_update(&editor->history, &node);
-                }
+// Walks nodes [first, last], handing the followed lines each one removed
+// to `visit`.
+static void diff_walk(diff_t* diff, ssize_t first, ssize_t last, rope_visitor_t visit) {
+    history_t* history = &diff->editor->history;
 
-                if (NULL == node.old_data) {
-                    editor->row_count = node.row_count;
-                    continue;
-                }
+    for (ssize_t i = first; i <= last && !diff->result; ++i) {
+        size_t removed;
+        size_t inserted;
+        diff->node = history->nodes + i;
+        if (!node_edit(diff->node, &removed, &inserted)) {
+            continue;
+        }
 
-                if (node.line_start + node.line_count >= node.row_count) {
-                    change_lines(editor,
-                                          node.line_start, node.row_count - node.line_start,
-                                          node.old_data, node.old_data_sizes);
-                } else {
-                    change_lines(editor,
-                                          node.line_start, node.line_count,
-                                          node.old_data, node.old_data_sizes);
-                }
-                break;
-            }
-            case DELETE: {
-                size_t line_end = node.line_start + node.line_count;
-                for (int i = editor->row_count - node.line_start - 1; i >= 0; --i) {
-                    editor->sizes[line_end + i] = editor->sizes[node.line_start + i];
-                    editor->rows[line_end + i] = editor->rows[node.line_start + i];
-                    /*memcpy(ROW(editor, line_end + i),
-                           ROW(editor, node.line_start + i),
-                           editor->sizes[line_end + i]);*/
-                    //ROW(editor, line_end + i)[editor->sizes[line_end + i]] = '\0';
-                }
+        diff->old_data = NULL;
+        diff->old_data_sizes = NULL;
+        diff->decoded = false;
+        rope_replace(&diff->rope, diff->node->line_start, removed, inserted, visit, diff);
 
-                if (NULL == node.old_data) {
-                    editor->row_count = node.row_count;
-                    continue;
-                }
+        if (diff->decoded) {
+            free(diff->old_data);
+            free(diff->old_data_sizes);
+        }
+    }
+}
 
-                change_lines(editor,
-                                      node.line_start, node.line_count,
-                                      node.old_data, node.old_data_sizes);
-                break;
-            }
+static void diff_take_old_lines(void* context, size_t base, size_t length, size_t position) {
+    diff_t* diff = (diff_t*) context;
+    if (ROPE_UNTRACKED == base || diff_node_old_data(diff)) {
+        return;
+    }
+
+    if (diff->old_lines_count + length > diff->old_lines_capacity) {
+        size_t new_capacity = 2 * (diff->old_lines_count + length);
+        diff_line_t* old_lines = (diff_line_t*) realloc(diff->old_lines, sizeof(diff_line_t) * new_capacity);
+        if (NULL == old_lines) {
+            diff->result = ERROR_MEMORY_ALLOCATION;
+            return;
         }
+        diff->old_lines = old_lines;
+        diff->old_lines_capacity = new_capacity;
+    }
 
-        editor->row_count = node.row_count;
+    for (size_t i = 0; i < length; ++i) {
+        diff_line_t* line = diff->old_lines + diff->old_lines_count++;
+        line->line = base + i;
+        line->row = diff->old_data[position + i];
+        line->size = diff->old_data_sizes[position + i];
     }
+}
 
-    return 0;
+static void diff_take_new_lines(void* context, size_t base, size_t length, size_t position) {
+    diff_t* diff = (diff_t*) context;
+    if (ROPE_UNTRACKED == base || diff_node_old_data(diff)) {
+        return;
+    }
+
+    memcpy(diff->new_rows + base, diff->old_data + position, sizeof(char*) * length);
+    memcpy(diff->new_sizes + base, diff->old_data_sizes + position, sizeof(size_t) * length);
 }
-int editor_redo(editor_t* editor, size_t count) {
-    int result;
-    history_node_t node;
 
-    while (count-- > 0) {
-        result = command_history_forward(&editor->history, &node);
-        if (result) {
-            return 0;
+static void diff_take_rows(void* context, size_t base, size_t length, size_t position) {
+    diff_t* diff = (diff_t*) context;
+    if (ROPE_UNTRACKED == base) {
+        return;
+    }
+
+    memcpy(diff->new_rows + base, diff->editor->rows + position, sizeof(char*) * length);
+    memcpy(diff->new_sizes + base, diff->editor->sizes + position, sizeof(size_t) * length);
+}
+
+static void diff_close_hunk(diff_t* diff, size_t old_end, size_t new_end) {
+    if (!diff->hunk_open) {
+        if (old_end == diff->old_position) {
+            return;
+        }
+        diff->hunk_old_start = diff->old_position;
+        diff->hunk_new_start = new_end;
+    }
+    diff->hunk_open = false;
+
+    if (diff->hunks_count >= diff->hunks_capacity) {
+        size_t new_capacity = diff->hunks_capacity ? diff->hunks_capacity * 2 : 16;
+        diff_hunk_t* hunks = (diff_hunk_t*) realloc(diff->hunks, sizeof(diff_hunk_t) * new_capacity);
+        if (NULL == hunks) {
+            diff->result = ERROR_MEMORY_ALLOCATION;
+            return;
         }
+        diff->hunks = hunks;
+        diff->hunks_capacity = new_capacity;
+    }
 
-        switch (node.type) {
-            case CHANGE:
-                change_lines(editor,
-                                      node.line_start, node.line_count,
-                                      node.data, node.data_sizes);
-                break;
-            case DELETE: {
-                if (editor->row_count > 0) {
-                    delete_lines(editor,
-                                          node.line_start, node.line_count);
-                }
-                break;
-            }
+    diff_hunk_t* hunk = diff->hunks + diff->hunks_count++;
+    hunk->old_start = diff->hunk_old_start;
+    hunk->old_len = old_end - diff->hunk_old_start;
+    hunk->new_start = diff->hunk_new_start;
+    hunk->new_len = new_end - diff->hunk_new_start;
+}
+
+// A hunk runs from a gap in the followed lines or an untracked segment to
+// the next followed line.
+static void diff_find_hunks(void* context, size_t base, size_t length, size_t position) {
+    diff_t* diff = (diff_t*) context;
+    if (ROPE_UNTRACKED == base) {
+        if (!diff->hunk_open) {
+            diff->hunk_open = true;
+            diff->hunk_old_start = diff->old_position;
+            diff->hunk_new_start = position;
         }
+        return;
     }
 
-    return 0;
+    diff_close_hunk(diff, base, position);
+    diff->old_position = base + length;
 }
 
-const char EMPTY_LINE_BUFFER[] = ".\n";
-const char NEW_LINE_BUFFER[] = "\n";
+static int compare_diff_lines(const void* a, const void* b) {
+    size_t line_a = ((const diff_line_t*) a)->line;
+    size_t line_b = ((const diff_line_t*) b)->line;
+    return line_a < line_b ? -1 : line_a > line_b;
+}
 
-int editor_print(editor_t* editor,
-                 size_t line_start, size_t lines_count, FILE* stream) {
-    for (int i = line_start; i < line_start + lines_count; ++i) {
-        if (i >= editor->row_count) {
-            // have a huge buffer and print some of it depending on how many empty lines
-            fwrite(EMPTY_LINE_BUFFER, 1, 2, stream);
-        } else {
-            fwrite(editor->rows[i], 1, editor->sizes[i], stream);
-            fwrite(NEW_LINE_BUFFER, 1, 1, stream);
-        }
+static bool diff_lines_equal(const diff_line_t* old_line, char* new_row, size_t new_size) {
+    return old_line->size == new_size &&
+           (old_line->row == new_row || 0 == memcmp(old_line->row, new_row, new_size));
+}
+
+static void diff_print_lines(editor_t* editor, char prefix, char** rows, size_t* sizes, size_t lines_count) {
+    for (size_t i = 0; i < lines_count; ++i) {
+        editor->sink(editor->sink_context, &prefix, 1);
+        editor->sink(editor->sink_context, rows[i], sizes[i]);
+        editor->sink(editor->sink_context, NEW_LINE_BUFFER, 1);
     }
+}
 
-    return 0;
+static void diff_print_hunk(diff_t* diff, const diff_hunk_t* hunk, const diff_line_t* old_lines,
+                            char** new_rows, size_t* new_sizes) {
+    editor_t* editor = diff->editor;
+    size_t old_start = hunk->old_start;
+    size_t new_start = hunk->new_start;
+    size_t old_len = hunk->old_len;
+    size_t new_len = hunk->new_len;
+
+    while (old_len > 0 && new_len > 0 && diff_lines_equal(old_lines, new_rows[0], new_sizes[0])) {
+        ++old_start;
+        ++new_start;
+        --old_len;
+        --new_len;
+        ++old_lines;
+        ++new_rows;
+        ++new_sizes;
+    }
+    while (old_len > 0 && new_len > 0 &&
+           diff_lines_equal(old_lines + old_len - 1, new_rows[new_len - 1], new_sizes[new_len - 1])) {
+        --old_len;
+        --new_len;
+    }
+    if (0 == old_len && 0 == new_len) {
+        return;
+    }
+
+    char header[80];
+    int header_size = snprintf(header, sizeof(header), "@@ -%zu,%zu +%zu,%zu @@\n",
+                               old_len ? old_start + 1 : old_start, old_len,
+                               new_len ? new_start + 1 : new_start, new_len);
+    editor->sink(editor->sink_context, header, header_size);
+
+    char prefix = '-';
+    for (size_t i = 0; i < old_len; ++i) {
+        editor->sink(editor->sink_context, &prefix, 1);
+        editor->sink(editor->sink_context, old_lines[i].row, old_lines[i].size);
+        editor->sink(editor->sink_context, NEW_LINE_BUFFER, 1);
+    }
+    diff_print_lines(editor, '+', new_rows, new_sizes, new_len);
 }
 
-int editor_change_history(editor_t* editor) {
-    int result = 0;
-    if (editor->delayed_history_change_count > 0) {
-        result = editor_redo(editor, editor->delayed_history_change_count);
-    } else if (editor->delayed_history_change_count < 0) {
-        result = editor_undo(editor, -editor->delayed_history_change_count);
+// Prints the lines that differ between versions `from` <= `to` <= history
+// index as hunks: "@@ -old_start,old_len +new_start,new_len @@" followed by
+// the old lines prefixed with '-' and the new ones prefixed with '+'. A
+// zero length range starts at the line it follows. A single "." ends the
+// diff. Nodes [from + 1, to] give the hunks and the old lines, nodes after
+// `to` and the rows give the new lines; each node is read once, and packed
+// nodes are decoded aside without being expanded.
+static int editor_diff(editor_t* editor, ssize_t from, ssize_t to) {
+    history_t* history = &editor->history;
+    if (from < -1 || from > to || to > history->index) {
+        return ERROR_INDEX_OUT_OF_BOUNDS;
     }
 
-    editor->delayed_history_change_count = 0;
-    return result;
+    diff_t diff;
+    memset(&diff, 0, sizeof(diff));
+    diff.editor = editor;
+
+    size_t from_rows = version_row_count(editor, from);
+    size_t to_rows = version_row_count(editor, to);
+
+    // follow the lines of `from` up to `to`
+    diff.result = rope_init(&diff.rope, 1 + 3 * (size_t) (to - from));
+    if (!diff.result) {
+        rope_append(&diff.rope, 0, from_rows);
+        diff_walk(&diff, from + 1, to, diff_take_old_lines);
+    }
+    if (!diff.result) {
+        rope_walk(&diff.rope, diff.rope.root, 0, diff_find_hunks, &diff);
+        diff_close_hunk(&diff, from_rows, to_rows);
+    }
+    rope_free(&diff.rope);
+
+    // the removed lines are exactly the old lines of the hunks
+    if (diff.old_lines_count > 0) {
+        qsort(diff.old_lines, diff.old_lines_count, sizeof(diff_line_t), compare_diff_lines);
+    }
+
+    // then the lines of `to` inside hunks up to the rows
+    size_t new_lines_count = 0;
+    for (size_t i = 0; i < diff.hunks_count; ++i) {
+        new_lines_count += diff.hunks[i].new_len;
+    }
+    if (!diff.result) {
+        diff.new_rows = (char**) malloc(sizeof(char*) * (new_lines_count + 1));
+        diff.new_sizes = (size_t*) malloc(sizeof(size_t) * (new_lines_count + 1));
+        if (NULL == diff.new_rows || NULL == diff.new_sizes) {
+            diff.result = ERROR_MEMORY_ALLOCATION;
+        }
+    }
+    if (!diff.result) {
+        diff.result = rope_init(&diff.rope, 2 * diff.hunks_count + 1 + 3 * (size_t) (history->index - to));
+    }
+    if (!diff.result) {
+        size_t line = 0;
+        size_t new_lines = 0;
+        for (size_t i = 0; i < diff.hunks_count; ++i) {
+            rope_append(&diff.rope, ROPE_UNTRACKED, diff.hunks[i].new_start - line);
+            rope_append(&diff.rope, new_lines, diff.hunks[i].new_len);
+            line = diff.hunks[i].new_start + diff.hunks[i].new_len;
+            new_lines += diff.hunks[i].new_len;
+        }
+        rope_append(&diff.rope, ROPE_UNTRACKED, to_rows - line);
+
+        diff_walk(&diff, to + 1, history->index, diff_take_new_lines);
+        rope_walk(&diff.rope, diff.rope.root, 0, diff_take_rows, &diff);
+    }
+    rope_free(&diff.rope);
+
+    if (!diff.result) {
+        size_t old_lines = 0;
+        size_t new_lines = 0;
+        for (size_t i = 0; i < diff.hunks_count; ++i) {
+            diff_print_hunk(&diff, diff.hunks + i, diff.old_lines + old_lines,
+                            diff.new_rows + new_lines, diff.new_sizes + new_lines);
+            old_lines += diff.hunks[i].old_len;
+            new_lines += diff.hunks[i].new_len;
+        }
+    }
+
+    editor->sink(editor->sink_context, EMPTY_LINE_BUFFER, 2);
+
+    free(diff.hunks);
+    free(diff.old_lines);
+    free(diff.new_rows);
+    free(diff.new_sizes);
+
+    return diff.result;
 }
 
 //=======================================================
 // PARSING
 //=======================================================
 
-#define COMMAND_CHANGE ('c')
-#define COMMAND_DELETE ('d')
-#define COMMAND_UNDO ('u')
-#define COMMAND_REDO ('r')
-#define COMMAND_PRINT ('p')
-#define COMMAND_EXIT ('q')
-
+// the text protocol is only read by main()
+#ifndef EDITOR_LIBRARY
 
-int parse_command_2_params(char *input, size_t command_char_index,
-                           int *first, int *second) {
+static int parse_command_2_params(char *input, size_t command_char_index,
+                                  int *first, int *second) {
     char* index_sep = memchr(input, ',', 20);
 
     char* end = input + command_char_index;
@@ -522,16 +2194,16 @@ int parse_command_2_params(char *input, size_t command_char_index,
     return 0;
 }
 
-int parse_command_1_param(char *input, size_t command_char_index, int *first) {
+static int parse_command_1_param(char *input, size_t command_char_index, int *first) {
     char* end = input + command_char_index;
     *first = strtol(input, &end, 10);
 
     return 0;
 }
 
-int parse_command(char* input, size_t input_size,
-                  char* command_char, bool* exit, bool* read_lines,
-                  int* first_index, int* second_index) {
+static int parse_command(char* input, size_t input_size,
+                         char* command_char, bool* exit, bool* read_lines,
+                         int* first_index, int* second_index) {
     int result = 0;
     *read_lines = false;
     *exit = false;
@@ -559,6 +2231,13 @@ int parse_command(char* input, size_t input_size,
             result = parse_command_2_params(input, command_char_index,
                                             first_index, second_index);
             break;
+        case COMMAND_DIFF:
+            result = parse_command_1_param(input, command_char_index, first_index);
+            break;
+        case COMMAND_FINGERPRINT:
+            result = parse_command_2_params(input, command_char_index,
+                                            first_index, second_index);
+            break;
         case COMMAND_EXIT:
             *exit = true;
             break;
@@ -570,8 +2249,10 @@ int parse_command(char* input, size_t input_size,
     return result;
 }
 
-int do_command(editor_t* editor, char* input, size_t lines_count, char command_char,
-               int first_index, int second_index, size_t input_size, size_t* input_sizes) {
+#endif //EDITOR_LIBRARY
+
+static int do_command(editor_t* editor, char* input, size_t lines_count, char command_char,
+                      int first_index, int second_index, size_t input_size, size_t* input_sizes) {
     int result;
     switch (command_char) {
         case COMMAND_CHANGE:
@@ -610,20 +2291,182 @@ int do_command(editor_t* editor, char* input, size_t lines_count, char command_c
         }
         case COMMAND_PRINT: {
             if (0 == first_index || 0 == second_index) {
-                fwrite(EMPTY_LINE_BUFFER, 1, 2, stdout);
+                editor->sink(editor->sink_context, EMPTY_LINE_BUFFER, 2);
                 return 0;
             } else {
                 // execute history change
                 editor_change_history(editor);
                 lines_count = second_index - first_index + 1;
-                return editor_print(editor, first_index - 1, lines_count, stdout);
+                return editor_print(editor, first_index - 1, lines_count);
+            }
+        }
+        case COMMAND_DIFF: {
+            // pending undos stay pending, the diff reads older versions from history
+            if (editor->delayed_history_change_count > 0) {
+                editor_change_history(editor);
+            }
+            ssize_t to = editor->history.index + editor->delayed_history_change_count;
+            ssize_t from = to - first_index < -1 ? -1 : to - first_index;
+            return editor_diff(editor, from, to);
+        }
+        case COMMAND_FINGERPRINT: {
+            uint64_t fingerprint;
+            if (0 == first_index || 0 == second_index) {
+                // the fingerprint of the lone "." such a print emits
+                fingerprint = missing_line_hash();
+            } else {
+                // execute history change
+                editor_change_history(editor);
+                lines_count = second_index - first_index + 1;
+                fingerprint = editor_fingerprint(editor, first_index - 1, lines_count);
             }
+
+            char output[20];
+            int output_size = snprintf(output, sizeof(output), "%016llx\n", (unsigned long long) fingerprint);
+            editor->sink(editor->sink_context, output, output_size);
+            return 0;
         }
     }
 
     return 1;
 }
 
+//=======================================================
+// LIBRARY
+//=======================================================
+
+editor_t* editor_create(editor_sink_t sink, void* context) {
+    editor_t* editor = (editor_t*) malloc(sizeof(editor_t));
+    if (NULL == editor) {
+        return NULL;
+    }
+
+    editor_init(editor);
+    if (NULL != sink) {
+        editor->sink = sink;
+        editor->sink_context = context;
+    }
+
+    return editor;
+}
+void editor_destroy(editor_t* editor) {
+    editor_free(editor);
+    free(editor);
+}
+
+void editor_set_history_compaction(editor_t* editor, size_t distance) {
+    command_history_set_compaction(&editor->history, distance);
+}
+void editor_history_stats(const editor_t* editor, editor_history_stats_t* stats) {
+    memcpy(stats, &editor->history.stats, sizeof(editor_history_stats_t));
+}
+void editor_set_history_coalescing(editor_t* editor, bool enabled) {
+    editor->coalesce_history = enabled;
+}
+void editor_set_print_cache(editor_t* editor, bool enabled) {
+    editor->print_cache_enabled = enabled;
+}
+
+static bool command_known(char command) {
+    switch (command) {
+        case COMMAND_CHANGE:
+        case COMMAND_DELETE:
+        case COMMAND_UNDO:
+        case COMMAND_REDO:
+        case COMMAND_PRINT:
+        case COMMAND_DIFF:
+        case COMMAND_FINGERPRINT:
+        case COMMAND_EXIT:
+            return true;
+        default:
+            return false;
+    }
+}
+static bool command_valid(const editor_command_t* command) {
+    switch (command->command) {
+        case COMMAND_EXIT:
+            return true;
+        case COMMAND_CHANGE:
+            return command->first_index >= 1 &&
+                   command->lines_count == command->second_index - command->first_index + 1;
+        case COMMAND_DELETE:
+            return command->first_index >= 1 && command->second_index >= command->first_index;
+        case COMMAND_PRINT:
+        case COMMAND_FINGERPRINT:
+            // 0 is allowed, such a range prints a single "."
+            return command->first_index >= 0 && command->second_index >= 0 &&
+                   (0 == command->first_index || command->second_index >= command->first_index);
+        case COMMAND_UNDO:
+        case COMMAND_REDO:
+        case COMMAND_DIFF:
+            return command->first_index >= 0;
+        default:
+            return false;
+    }
+}
+
+// Sizes history and row storage for the whole batch up front, so the
+// per-command paths never need to grow them.
+static int reserve_batch(editor_t* editor, const editor_command_t* commands, size_t count) {
+    size_t appended_nodes = 0;
+    size_t max_line_end = 0;
+
+    for (size_t i = 0; i < count; ++i) {
+        const editor_command_t* command = commands + i;
+        if (COMMAND_EXIT == command->command || !command_valid(command)) {
+            break;
+        }
+        if (COMMAND_CHANGE == command->command) {
+            size_t line_end = command->first_index - 1 + command->lines_count;
+            max_line_end = line_end > max_line_end ? line_end : max_line_end;
+            ++appended_nodes;
+        } else if (COMMAND_DELETE == command->command) {
+            ++appended_nodes;
+        }
+    }
+
+    history_t* history = &editor->history;
+    int result = command_history_reserve(history, history->index + 1 + appended_nodes + 1);
+    if (result) {
+        return result;
+    }
+
+    if (max_line_end >= editor->row_capacity) {
+        return expand_buffers(editor, max_line_end);
+    }
+
+    return 0;
+}
+
+int editor_apply(editor_t* editor, const editor_command_t* commands, size_t count) {
+    int result = reserve_batch(editor, commands, count);
+    if (result) {
+        return result;
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+        const editor_command_t* command = commands + i;
+
+        if (COMMAND_EXIT == command->command) {
+            return 0;
+        }
+        if (!command_valid(command)) {
+            return command_known(command->command) ? ERROR_COMMAND_PARAMETERS : ERROR_UNKNOWN_COMMAND;
+        }
+
+        result = do_command(editor, command->data, command->lines_count, command->command,
+                            command->first_index, command->second_index,
+                            command->data_size, command->data_sizes);
+        if (result) {
+            return result;
+        }
+    }
+
+    return 0;
+}
+
+#ifndef EDITOR_LIBRARY
+
 //=======================================================
 // MAIN
 //=======================================================
@@ -631,7 +2474,19 @@ int do_command(editor_t* editor, char* input, size_t lines_count, char command_c
 #define INPUT_BUFFER_SIZE (1026)
 #define LINES_BUFFER_SIZE (4096 * 15)
 
+// 0 keeps every history node expanded
+#ifndef HISTORY_COMPACTION_DISTANCE
+#define HISTORY_COMPACTION_DISTANCE (0)
+#endif
+#ifndef HISTORY_COALESCING
+#define HISTORY_COALESCING (false)
+#endif
+#ifndef PRINT_CACHE
+#define PRINT_CACHE (false)
+#endif
+
 //#define TIME_CHECK
+//#define HISTORY_STATS
 
 #ifdef TIME_CHECK
 #include <time.h>
@@ -679,6 +2534,9 @@ int main() {
 
     editor_t editor;
     editor_init(&editor);
+    command_history_set_compaction(&editor.history, HISTORY_COMPACTION_DISTANCE);
+    editor.coalesce_history = HISTORY_COALESCING;
+    editor.print_cache_enabled = PRINT_CACHE;
 
     char* orig_lines_buffer = lines_buffer;
 
@@ -743,6 +2601,15 @@ int main() {
                             input_sizes);
     }
 
+#ifdef HISTORY_STATS
+    editor_history_stats_t stats = editor.history.stats;
+    fprintf(stderr, "history: %zu nodes packed, ratio %.2f, %zu inflated, %.0f ns per inflate\n",
+            stats.compacted_nodes,
+            stats.packed_bytes ? (double) stats.raw_bytes / (double) stats.packed_bytes : 0.0,
+            stats.inflated_nodes,
+            stats.inflated_nodes ? stats.inflate_seconds * 1e9 / (double) stats.inflated_nodes : 0.0);
+#endif
+
     free(orig_lines_buffer);
     free(input_sizes);
     editor_free(&editor);
@@ -754,4 +2621,4 @@ int main() {
     return 0;
 }
 
-
+#endif //EDITOR_LIBRARY
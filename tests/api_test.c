@@ -0,0 +1,226 @@
+// Drives the library build through editor.h only: linked against main.c
+// compiled with -DEDITOR_LIBRARY by run_tests.sh.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../editor.h"
+
+static int failures = 0;
+
+#define CHECK(condition, name) \
+    do { \
+        if (!(condition)) { \
+            fprintf(stderr, "FAIL %s: %s\n", (name), #condition); \
+            ++failures; \
+        } \
+    } while (0)
+
+typedef struct {
+    char data[4096];
+    size_t size;
+} output_t;
+
+static size_t collect(void* context, const char* data, size_t size) {
+    output_t* output = (output_t*) context;
+    if (output->size + size >= sizeof(output->data)) {
+        size = sizeof(output->data) - output->size - 1;
+    }
+    memcpy(output->data + output->size, data, size);
+    output->size += size;
+    output->data[output->size] = '\0';
+    return size;
+}
+
+// Takes the printed lines since the last call.
+static const char* take(output_t* output) {
+    static char taken[sizeof(output->data)];
+    memcpy(taken, output->data, output->size + 1);
+    output->size = 0;
+    output->data[0] = '\0';
+    return taken;
+}
+
+static editor_command_t command(char name, int first, int second) {
+    editor_command_t command = {
+            .command = name,
+            .first_index = first,
+            .second_index = second,
+            .data = NULL,
+            .data_size = 0,
+            .data_sizes = NULL,
+            .lines_count = 0
+    };
+    return command;
+}
+
+// `text` holds the lines each followed by '\n', `sizes` has room for them.
+static editor_command_t change(int first, int second, char* text, size_t* sizes) {
+    editor_command_t result = command(COMMAND_CHANGE, first, second);
+    result.data = text;
+    result.data_size = strlen(text);
+    result.data_sizes = sizes;
+
+    char* line = text;
+    char* end;
+    while (NULL != (end = strchr(line, '\n'))) {
+        sizes[result.lines_count++] = end - line;
+        line = end + 1;
+    }
+    return result;
+}
+
+static void test_apply(void) {
+    output_t output = {.size = 0};
+    editor_t* editor = editor_create(collect, &output);
+    CHECK(NULL != editor, "create");
+
+    char text[] = "one\ntwo\nthree\n";
+    size_t sizes[3];
+    char more[] = "TWO\n";
+    size_t more_sizes[1];
+    editor_command_t commands[] = {
+            change(1, 3, text, sizes),
+            command(COMMAND_PRINT, 1, 4),
+            change(2, 2, more, more_sizes),
+            command(COMMAND_DELETE, 1, 1),
+            command(COMMAND_PRINT, 1, 3),
+            command(COMMAND_UNDO, 2, 0),
+            command(COMMAND_PRINT, 0, 0),
+            command(COMMAND_PRINT, 1, 2),
+            command(COMMAND_REDO, 1, 0),
+            command(COMMAND_DIFF, 1, 0),
+            command(COMMAND_EXIT, 0, 0),
+            // not reached
+            command(COMMAND_PRINT, 1, 1)
+    };
+    CHECK(0 == editor_apply(editor, commands, sizeof(commands) / sizeof(commands[0])), "apply");
+    CHECK(0 == strcmp(take(&output),
+                      "one\ntwo\nthree\n.\n"
+                      "TWO\nthree\n.\n"
+                      ".\n"
+                      "one\ntwo\n"
+                      "@@ -2,1 +2,1 @@\n-two\n+TWO\n.\n"), "apply output");
+
+    // the same editor keeps going across batches
+    editor_command_t print = command(COMMAND_PRINT, 1, 3);
+    CHECK(0 == editor_apply(editor, &print, 1), "second batch");
+    CHECK(0 == strcmp(take(&output), "one\nTWO\nthree\n"), "second batch output");
+
+    editor_destroy(editor);
+}
+
+static void test_validation(void) {
+    output_t output = {.size = 0};
+    editor_t* editor = editor_create(collect, &output);
+
+    char text[] = "a\nb\n";
+    size_t sizes[2];
+    editor_command_t load = change(1, 2, text, sizes);
+    CHECK(0 == editor_apply(editor, &load, 1), "load");
+
+    editor_command_t commands[] = {
+            command(COMMAND_DELETE, 0, 1),
+            command(COMMAND_DELETE, 2, 1),
+            command(COMMAND_PRINT, 3, 2),
+            command(COMMAND_PRINT, -1, 2),
+            command(COMMAND_UNDO, -1, 0),
+            command(COMMAND_REDO, -1, 0),
+            command(COMMAND_DIFF, -1, 0)
+    };
+    for (size_t i = 0; i < sizeof(commands) / sizeof(commands[0]); ++i) {
+        CHECK(ERROR_COMMAND_PARAMETERS == editor_apply(editor, commands + i, 1), "bad range");
+    }
+
+    editor_command_t unknown = command('x', 1, 1);
+    CHECK(ERROR_UNKNOWN_COMMAND == editor_apply(editor, &unknown, 1), "unknown command");
+
+    // three lines for a two line range
+    char three[] = "x\ny\nz\n";
+    size_t three_sizes[3];
+    editor_command_t mismatch = change(1, 2, three, three_sizes);
+    CHECK(ERROR_COMMAND_PARAMETERS == editor_apply(editor, &mismatch, 1), "lines count");
+
+    // line 4 would leave line 3 missing
+    char past[] = "x\n";
+    size_t past_sizes[1];
+    editor_command_t past_end = change(4, 4, past, past_sizes);
+    CHECK(ERROR_INDEX_OUT_OF_BOUNDS == editor_apply(editor, &past_end, 1), "change past end");
+
+    // a delete past the end is one empty step of history
+    editor_command_t batch[] = {
+            command(COMMAND_DELETE, 5, 6),
+            command(COMMAND_UNDO, 1, 0),
+            command(COMMAND_PRINT, 1, 2),
+            command(COMMAND_UNDO, 1, 0),
+            command(COMMAND_PRINT, 1, 1)
+    };
+    CHECK(0 == editor_apply(editor, batch, sizeof(batch) / sizeof(batch[0])), "delete past end");
+
+    // a batch stops at its first invalid command
+    editor_command_t stop[] = {
+            command(COMMAND_PRINT, 2, 2),
+            command(COMMAND_DELETE, 0, 0),
+            command(COMMAND_PRINT, 1, 1)
+    };
+    CHECK(ERROR_COMMAND_PARAMETERS == editor_apply(editor, stop, 3), "stop");
+    CHECK(0 == strcmp(take(&output), "a\nb\n.\n.\n"), "validation output");
+
+    editor_destroy(editor);
+}
+
+// 1000 four-line changes, each over the previous one.
+static editor_t* editor_with_history(void) {
+    static char text[] = "first\nsecond\nthird\nfourth\n";
+    static size_t sizes[4];
+    static output_t output;
+
+    editor_t* editor = editor_create(collect, &output);
+    editor_command_t load = change(1, 4, text, sizes);
+    for (int i = 0; i < 1000; ++i) {
+        editor_apply(editor, &load, 1);
+    }
+    return editor;
+}
+
+static void test_compaction(void) {
+    editor_history_stats_t stats;
+
+    // nodes 0..989 are beyond, but node 0 has no lines to pack
+    editor_t* editor = editor_with_history();
+    editor_set_history_compaction(editor, 10);
+    editor_history_stats(editor, &stats);
+    CHECK(989 == stats.compacted_nodes, "enable");
+    CHECK(stats.packed_bytes < stats.raw_bytes, "enable");
+
+    editor_command_t undo = command(COMMAND_UNDO, 500, 0);
+    editor_command_t print = command(COMMAND_PRINT, 1, 1);
+    editor_apply(editor, &undo, 1);
+    editor_apply(editor, &print, 1);
+    editor_history_stats(editor, &stats);
+    CHECK(490 == stats.inflated_nodes, "undo");
+    editor_destroy(editor);
+
+    editor = editor_with_history();
+    editor_set_history_compaction(editor, 100);
+    editor_history_stats(editor, &stats);
+    CHECK(899 == stats.compacted_nodes, "distance");
+    editor_set_history_compaction(editor, 10);
+    editor_history_stats(editor, &stats);
+    CHECK(989 == stats.compacted_nodes, "lower");
+    editor_destroy(editor);
+}
+
+int main() {
+    test_apply();
+    test_validation();
+    test_compaction();
+
+    if (failures) {
+        fprintf(stderr, "%d check(s) failed\n", failures);
+        return 1;
+    }
+    printf("api_test: ok\n");
+    return 0;
+}
@@ -0,0 +1,143 @@
+// Round-trip checks for the history compaction codec. Built by run_tests.sh
+// against main.c itself, so the static helpers are reachable.
+
+#define EDITOR_LIBRARY
+#include "../main.c"
+
+static int failures = 0;
+
+#define CHECK(condition, name) \
+    do { \
+        if (!(condition)) { \
+            fprintf(stderr, "FAIL %s: %s\n", (name), #condition); \
+            ++failures; \
+        } \
+    } while (0)
+
+static void check_lz_round_trip(const char* name, const unsigned char* input, size_t size) {
+    unsigned char* packed = (unsigned char*) malloc(lz_bound(size));
+    unsigned char* unpacked = (unsigned char*) malloc(size + 1);
+
+    size_t packed_size = lz_compress(input, size, packed);
+    CHECK(packed_size <= lz_bound(size), name);
+    CHECK(0 == lz_decompress(packed, packed_size, unpacked, size), name);
+    CHECK(0 == size || 0 == memcmp(input, unpacked, size), name);
+
+    // a wrong expected size must be rejected, not overrun
+    CHECK(0 != lz_decompress(packed, packed_size, unpacked, size + 1), name);
+
+    free(packed);
+    free(unpacked);
+}
+
+static void test_lz(void) {
+    unsigned char buffer[8192] = {0};
+
+    check_lz_round_trip("empty", buffer, 0);
+
+    buffer[0] = 'x';
+    check_lz_round_trip("single byte", buffer, 1);
+
+    memset(buffer, 'a', sizeof(buffer));
+    check_lz_round_trip("run", buffer, sizeof(buffer));
+
+    // offset 2 matches overlap the bytes they produce
+    for (size_t i = 0; i < 1000; ++i) {
+        buffer[i] = "ab"[i % 2];
+    }
+    check_lz_round_trip("overlapping match", buffer, 1000);
+
+    uint32_t seed = 12345;
+    for (size_t i = 0; i < sizeof(buffer); ++i) {
+        seed = seed * 1103515245u + 12345u;
+        buffer[i] = (unsigned char) (seed >> 16);
+    }
+    check_lz_round_trip("literals 15", buffer, 15);
+    check_lz_round_trip("literals 270", buffer, 270);
+    check_lz_round_trip("literals 8192", buffer, sizeof(buffer));
+
+    // long literal run, then a match longer than 15 + 255
+    memset(buffer + 300, 'z', 600);
+    memcpy(buffer + 900, buffer, 300);
+    check_lz_round_trip("mixed", buffer, 1500);
+}
+
+static void test_pack_lines(void) {
+    char text[] = "first\nsecond\n\nfourth\n";
+    char* lines[] = {text + 14, text, text + 6, text + 13};
+    size_t sizes[] = {6, 5, 6, 0};
+
+    unsigned char raw[VARINT_MAX_SIZE * 16];
+    uintptr_t expected = 0;
+    size_t raw_size = pack_lines(raw, 0, &expected, lines, sizes, 4);
+    raw_size = pack_lines(raw, raw_size, &expected, NULL, NULL, 0);
+
+    size_t in = 0;
+    char** unpacked;
+    size_t* unpacked_sizes;
+    expected = 0;
+    CHECK(0 == unpack_lines(raw, raw_size, &in, &expected, &unpacked, &unpacked_sizes), "pack lines");
+    for (int i = 0; i < 4; ++i) {
+        CHECK(unpacked[i] == lines[i] && unpacked_sizes[i] == sizes[i], "pack lines");
+    }
+    free(unpacked);
+    free(unpacked_sizes);
+
+    CHECK(0 == unpack_lines(raw, raw_size, &in, &expected, &unpacked, &unpacked_sizes), "pack NULL");
+    CHECK(NULL == unpacked && NULL == unpacked_sizes && in == raw_size, "pack NULL");
+
+    // truncated input is an error
+    in = 0;
+    expected = 0;
+    CHECK(0 != unpack_lines(raw, 3, &in, &expected, &unpacked, &unpacked_sizes), "truncated");
+}
+
+static void test_node_pack(void) {
+    char text[] = "a\nbb\nccc\ndddd\n";
+    history_t history;
+    command_history_init(&history);
+
+    size_t count = 64;
+    history_node_t node = {
+            .type = CHANGE,
+            .line_start = 0,
+            .line_count = count,
+            .row_count = count
+    };
+    node.old_data = (char**) malloc(sizeof(char*) * count);
+    node.old_data_sizes = (size_t*) malloc(sizeof(size_t) * count);
+    for (size_t i = 0; i < count; ++i) {
+        size_t line = i % 4;
+        node.old_data[i] = text + line * (line + 1) / 2 + line;
+        node.old_data_sizes[i] = line + 1;
+    }
+    char** old_data = (char**) malloc(sizeof(char*) * count);
+    memcpy(old_data, node.old_data, sizeof(char*) * count);
+
+    CHECK(0 == node_pack(&history, &node), "node pack");
+    CHECK(NULL != node.packed && NULL == node.old_data, "node pack");
+    CHECK(history.stats.packed_bytes < history.stats.raw_bytes, "node pack");
+
+    CHECK(0 == node_unpack(&history, &node), "node unpack");
+    CHECK(NULL == node.packed && NULL == node.data, "node unpack");
+    for (size_t i = 0; i < count; ++i) {
+        CHECK(node.old_data[i] == old_data[i] && node.old_data_sizes[i] == i % 4 + 1, "node unpack");
+    }
+
+    free(old_data);
+    free_node_contents(&node);
+    command_history_free(&history);
+}
+
+int main() {
+    test_lz();
+    test_pack_lines();
+    test_node_pack();
+
+    if (failures) {
+        fprintf(stderr, "%d check(s) failed\n", failures);
+        return 1;
+    }
+    printf("codec_test: ok\n");
+    return 0;
+}
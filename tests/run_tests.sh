@@ -0,0 +1,44 @@
+#!/bin/sh
+# Builds the codec and library API tests and the editor in every history mode, then runs each
+# tests/scripts/*.in through each build and compares with its .expected.
+set -e
+
+TESTS_DIR=$(cd "$(dirname "$0")" && pwd)
+ROOT_DIR=$(dirname "$TESTS_DIR")
+BUILD_DIR=${BUILD_DIR:-$(mktemp -d)}
+CC=${CC:-cc}
+CFLAGS=${CFLAGS:--O1 -g}
+
+$CC $CFLAGS -o "$BUILD_DIR/codec_test" "$TESTS_DIR/codec_test.c"
+"$BUILD_DIR/codec_test"
+
+$CC $CFLAGS -DEDITOR_LIBRARY -o "$BUILD_DIR/api_test" "$TESTS_DIR/api_test.c" "$ROOT_DIR/main.c"
+"$BUILD_DIR/api_test"
+
+# every mode must print exactly what the plain build prints
+MODES="plain:
+compact1:-DHISTORY_COMPACTION_DISTANCE=1
+compact3:-DHISTORY_COMPACTION_DISTANCE=3
+coalesce:-DHISTORY_COALESCING=true
+coalesce_compact1:-DHISTORY_COALESCING=true,-DHISTORY_COMPACTION_DISTANCE=1
+print_cache:-DPRINT_CACHE=true"
+
+failed=0
+for mode in $MODES; do
+    name=${mode%%:*}
+    flags=$(echo "${mode#*:}" | tr ',' ' ')
+    $CC $CFLAGS $flags -o "$BUILD_DIR/editor_$name" "$ROOT_DIR/main.c"
+
+    for script in "$TESTS_DIR"/scripts/*.in; do
+        expected=${script%.in}.expected
+        if ! "$BUILD_DIR/editor_$name" < "$script" | cmp -s - "$expected"; then
+            echo "FAIL $(basename "$script") [$name]"
+            failed=1
+        fi
+    done
+done
+
+if [ "$failed" -ne 0 ]; then
+    exit 1
+fi
+echo "scripts: ok"